@@ -0,0 +1,78 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 gsick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Allocation counters and report of the benchmarks, see `make bench`.
+ * The objects are linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=strdup
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+uint64_t bench_allocs = 0;
+const void* volatile bench_sink = NULL;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+char* __real_strdup(const char* s);
+
+
+void* __wrap_malloc(size_t size) {
+  bench_allocs++;
+  return __real_malloc(size);
+}
+
+
+void* __wrap_calloc(size_t nmemb, size_t size) {
+  bench_allocs++;
+  return __real_calloc(nmemb, size);
+}
+
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  bench_allocs++;
+  return __real_realloc(ptr, size);
+}
+
+
+char* __wrap_strdup(const char* s) {
+  bench_allocs++;
+  return __real_strdup(s);
+}
+
+
+void bench_report(const char* name, uint64_t ops, uint64_t start, uint64_t allocs) {
+
+  uint64_t elapsed = bench_ns() - start;
+  printf("%-44s %12llu ops %12.1f ns/op %8.2f allocs/op\n", name,
+         (unsigned long long)ops, ops ? (double)elapsed / ops : 0,
+         ops ? (double)(bench_allocs - allocs) / ops : 0);
+}
+
+
+void bench_use(const void* p) {
+  bench_sink = p;
+}
@@ -0,0 +1,83 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 gsick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * redisFormatCommandArgv with a varying argc. One op is one command.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hiredis-light.h"
+#include "bench.h"
+
+#define BENCH_COMMANDS 1000000
+#define BENCH_MAX_ARGC 1000
+
+
+static void run(const char* name, int argc, size_t arglen, bool lengths) {
+
+  static const char* argv[BENCH_MAX_ARGC];
+  static size_t argvlen[BENCH_MAX_ARGC];
+  char* arg = (char*)malloc(arglen + 1);
+  memset(arg, 'x', arglen);
+  arg[arglen] = '\0';
+
+  int i;
+  argv[0] = "SET";
+  argvlen[0] = 3;
+  for (i = 1; i < argc; i++) {
+    argv[i] = arg;
+    argvlen[i] = arglen;
+  }
+
+  uint64_t ops = BENCH_COMMANDS / argc;
+  uint64_t allocs = bench_allocs;
+  uint64_t start = bench_ns();
+  uint64_t n;
+  for (n = 0; n < ops; n++) {
+    char* cmd;
+    int len = redisFormatCommandArgv(&cmd, argc, argv, lengths ? argvlen : NULL);
+    assert(len > 0);
+    bench_use(cmd);
+    free(cmd);
+  }
+  bench_report(name, ops, start, allocs);
+  free(arg);
+}
+
+
+int main(void) {
+
+  printf("formatter\n");
+  run("argc 1", 1, 8, true);
+  run("argc 3 x 8B", 3, 8, true);
+  run("argc 3 x 8B, strlen", 3, 8, false);
+  run("argc 3 x 1KB", 3, 1024, true);
+  run("argc 10 x 8B", 10, 8, true);
+  run("argc 100 x 8B", 100, 8, true);
+  run("argc 1000 x 8B", 1000, 8, true);
+  return 0;
+}
@@ -0,0 +1,312 @@
+--[[
+
+The MIT License (MIT)
+
+Copyright (c) 2015 gsick
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+--]]
+
+--[[
+
+Open-loop load generator. The commands are sent at the target rate whatever
+the replies, the latency of a command is measured from its intended send time
+so a stall of the client or of Redis is counted for every command it delays
+(no coordinated omission).
+
+  luvit bench/loadgen.lua [--socket path] [--rate n] [--duration s]
+                          [--sweep from:to:step] [--knee factor]
+                          [--command "set key:%d value"] [--keys n]
+                          [--storm] [--subscribers n] [--storm-keys n]
+                          [--auto-notify-config]
+
+--rate: commands per second, --sweep: one step per rate until the
+saturation knee, the first rate not achieved (95%) or with a p99 above
+knee (10) times the one of the first step.
+--storm: SET at the rate on key:0 to key:<storm-keys - 1>, each of the
+subscribers subscribed to all of their key-space notifications, the
+latency is from the intended SET to the notification callback.
+
+The latencies are in us, the histograms come from CrazySnail.histogram().
+
+--]]
+
+local Timer = require('timer')
+local CrazySnail = require('crazy-snail')
+
+local options = {
+  socket = "/var/run/redis/redis.sock",
+  rate = 10000,
+  duration = 10,
+  sweep = nil,
+  knee = 10,
+  command = "set key:%d value",
+  keys = 10000,
+  storm = false,
+  subscribers = 10,
+  storm_keys = 100,
+  auto_notify_config = false,
+  -- Scheduler tick (ms) and wait for the last replies (s)
+  tick = 1,
+  drain = 5
+}
+
+local function parse_args(argv)
+  local i = 1
+  while i <= #argv do
+    local name = argv[i]:match("^%-%-(.+)$")
+    if name ~= nil then
+      name = name:gsub("%-", "_")
+      if type(options[name]) == "boolean" then
+        options[name] = true
+      elseif argv[i + 1] ~= nil then
+        options[name] = tonumber(argv[i + 1]) or argv[i + 1]
+        i = i + 1
+      end
+    end
+    i = i + 1
+  end
+end
+
+parse_args(process and process.argv or args or {})
+
+local template = {}
+for word in options.command:gmatch("%S+") do
+  template[#template + 1] = word
+end
+
+local function build_command(n)
+  local command = {}
+  for i, word in ipairs(template) do
+    command[i] = word:find("%%d") and word:format(n % options.keys) or word
+  end
+  return command
+end
+
+local function connect(count, config, done)
+  local clients = {}
+  local connected = 0
+  for i = 1, count do
+    local snail = CrazySnail.new(config)
+    snail:on("connect", function()
+      connected = connected + 1
+      if connected == count then
+        done(clients)
+      end
+    end)
+    snail:on("error", function(err)
+      print("error", err)
+    end)
+    clients[i] = snail
+    snail:connect()
+  end
+end
+
+local function report_line(result)
+  local l = result.latency
+  print(string.format("%10d %10.0f %8d %8d %10.0f %10.0f %10.0f %10.0f %10.0f",
+    result.rate, result.throughput, result.errors, result.lost,
+    l.p50, l.p99, l.p999, l.p9999, l.max))
+end
+
+local function report_header()
+  print(string.format("%10s %10s %8s %8s %10s %10s %10s %10s %10s",
+    "rate", "achieved", "errors", "lost", "p50", "p99", "p99.9", "p99.99", "max"))
+end
+
+--[[ One step at a fixed rate, done(result) after the last reply or the drain time ]]
+local function run_step(snail, rate, on_sent, done)
+  local latency = CrazySnail.histogram()
+  local interval = 1e9 / rate
+  local total = math.floor(rate * options.duration)
+  local start = CrazySnail.now()
+  local pending = {}
+  local issued, replied, errors = 0, 0, 0
+  local finished = false
+  local ticker, deadline
+
+  local function finish()
+    if finished then
+      return
+    end
+    finished = true
+    if deadline ~= nil then
+      Timer.clearTimer(deadline)
+    end
+    -- The commands without reply count until now
+    local now = CrazySnail.now()
+    local lost = 0
+    for _, intended in pairs(pending) do
+      latency:record((now - intended) / 1000)
+      lost = lost + 1
+    end
+    local elapsed = (now - start) / 1e9
+    done({
+      rate = rate,
+      sent = issued,
+      replies = replied,
+      errors = errors,
+      lost = lost,
+      throughput = replied / elapsed,
+      latency = latency:totable()
+    })
+  end
+
+  local function on_tick()
+    local now = CrazySnail.now()
+    local due = math.min(total, math.floor((now - start) / interval))
+    while issued < due do
+      local id = issued
+      local intended = start + id * interval
+      local command = build_command(id)
+      pending[id] = intended
+      command[#command + 1] = function(err)
+        if finished then
+          return
+        end
+        pending[id] = nil
+        replied = replied + 1
+        if err then
+          errors = errors + 1
+        end
+        latency:record((CrazySnail.now() - intended) / 1000)
+        if replied == total then
+          finish()
+        end
+      end
+      snail:command(unpack(command))
+      if on_sent then
+        on_sent(id, intended, command[2])
+      end
+      issued = issued + 1
+    end
+    if issued == total then
+      Timer.clearTimer(ticker)
+      deadline = Timer.setTimeout(options.drain * 1000, finish)
+    end
+  end
+
+  ticker = Timer.setInterval(options.tick, on_tick)
+end
+
+local function sweep_rates()
+  if options.sweep == nil then
+    return {options.rate}
+  end
+  local from, to, step = tostring(options.sweep):match("^(%d+):(%d+):(%d+)$")
+  assert(from, "--sweep from:to:step")
+  local rates = {}
+  for rate = tonumber(from), tonumber(to), tonumber(step) do
+    rates[#rates + 1] = rate
+  end
+  return rates
+end
+
+local function exit(clients)
+  for _, snail in ipairs(clients) do
+    snail:disconnect()
+  end
+  process.exit(0)
+end
+
+local function run_sweep(clients)
+  local rates = sweep_rates()
+  local baseline, knee
+  local i = 0
+  report_header()
+  local function next_step()
+    i = i + 1
+    if i > #rates then
+      print(knee and ("saturation knee: " .. knee .. " commands/s") or "no saturation")
+      return exit(clients)
+    end
+    run_step(clients[1], rates[i], nil, function(result)
+      report_line(result)
+      baseline = baseline or result.latency.p99
+      local saturated = result.throughput < 0.95 * result.rate
+        or result.latency.p99 > options.knee * baseline
+      if saturated then
+        knee = rates[i - 1] or rates[i]
+        i = #rates
+      end
+      next_step()
+    end)
+  end
+  next_step()
+end
+
+local function run_storm(producer)
+  local config = {path = options.socket, auto_notify_config = options.auto_notify_config}
+  connect(options.subscribers, config, function(subscribers)
+    local notifications = CrazySnail.histogram()
+    -- Intended times of the SETs by key, in order
+    local sent_at = {}
+    local received = 0
+    local keys = {}
+    for k = 0, options.storm_keys - 1 do
+      keys[#keys + 1] = "key:" .. k
+    end
+    local subscribed = 0
+    for _, snail in ipairs(subscribers) do
+      local seen = {}
+      keys[#keys + 1] = function(err, res)
+        if err or res == nil or res[2] ~= "set" then
+          return
+        end
+        local key = res[1]
+        seen[key] = (seen[key] or 0) + 1
+        local intended = sent_at[key] and sent_at[key][seen[key]]
+        if intended then
+          received = received + 1
+          notifications:record((CrazySnail.now() - intended) / 1000)
+        end
+      end
+      snail:subscribe(unpack(keys))
+      keys[#keys] = nil
+    end
+
+    template = {"set", "key:%d", "value"}
+    options.keys = options.storm_keys
+    -- Wait for the subscriptions
+    Timer.setTimeout(1000, function()
+      report_header()
+      run_step(producer, options.rate, function(id, intended, key)
+        sent_at[key] = sent_at[key] or {}
+        table.insert(sent_at[key], intended)
+      end, function(result)
+        report_line(result)
+        local l = notifications:totable()
+        print(string.format("notifications %d / %d expected, p50 %.0f p99 %.0f p99.9 %.0f p99.99 %.0f max %.0f us",
+          received, result.sent * options.subscribers, l.p50, l.p99, l.p999, l.p9999, l.max))
+        for _, snail in ipairs(subscribers) do
+          snail:disconnect()
+        end
+        exit({producer})
+      end)
+    end)
+  end)
+end
+
+connect(1, {path = options.socket}, function(clients)
+  if options.storm then
+    run_storm(clients[1])
+  else
+    run_sweep(clients)
+  end
+end)
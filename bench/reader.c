@@ -0,0 +1,151 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 gsick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * redisReaderFeed / redisReaderGetReply over representative replies.
+ * One op is one reply.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hiredis-light.h"
+#include "sds.h"
+#include "bench.h"
+
+/* Bytes parsed per case */
+#define BENCH_BYTES (64 << 20)
+
+
+static sds bulk(sds s, size_t len) {
+
+  s = sdscatprintf(s, "$%zu\r\n", len);
+  size_t i;
+  for (i = 0; i < len; i++) {
+    s = sdscatlen(s, "x", 1);
+  }
+  return sdscatlen(s, "\r\n", 2);
+}
+
+
+/* Nested arrays of width elements, bulk strings at the last level */
+static sds nested(sds s, int depth, int width) {
+
+  s = sdscatprintf(s, "*%d\r\n", width);
+  int i;
+  for (i = 0; i < width; i++) {
+    s = depth > 1 ? nested(s, depth - 1, width) : bulk(s, 8);
+  }
+  return s;
+}
+
+
+/* Feed buf (replies times the same reply) in slices of step bytes */
+static void run(const char* name, const char* buf, size_t len, int replies,
+                size_t step) {
+
+  redisReader* reader = redisReaderCreate();
+  assert(reader != NULL);
+
+  uint64_t iterations = BENCH_BYTES / len;
+  if (iterations < 20) {
+    iterations = 20;
+  }
+  if (iterations > 1000000) {
+    iterations = 1000000;
+  }
+
+  uint64_t allocs = bench_allocs;
+  uint64_t start = bench_ns();
+  uint64_t i, ops = 0;
+  for (i = 0; i < iterations; i++) {
+    size_t off;
+    for (off = 0; off < len; off += step) {
+      int r = redisReaderFeed(reader, buf + off, len - off < step ? len - off : step);
+      assert(r == REDIS_OK);
+      void* reply = NULL;
+      while (redisReaderGetReply(reader, &reply) == REDIS_OK && reply != NULL) {
+        freeReplyObject(reply);
+        reply = NULL;
+        ops++;
+      }
+    }
+  }
+  bench_report(name, ops, start, allocs);
+  assert(ops == iterations * replies);
+  redisReaderFree(reader);
+}
+
+
+int main(void) {
+
+  sds s;
+  int i;
+
+  printf("reader\n");
+  run("status +OK", "+OK\r\n", 5, 1, 5);
+  run("integer", ":1234567\r\n", 10, 1, 10);
+
+  s = bulk(sdsempty(), 16);
+  run("bulk 16B", s, sdslen(s), 1, sdslen(s));
+  sdsfree(s);
+  s = bulk(sdsempty(), 16 << 10);
+  run("bulk 16KB", s, sdslen(s), 1, sdslen(s));
+  run("bulk 16KB, 1KB reads", s, sdslen(s), 1, 1024);
+  sdsfree(s);
+  s = bulk(sdsempty(), 1 << 20);
+  run("bulk 1MB, 64KB reads", s, sdslen(s), 1, 64 << 10);
+  sdsfree(s);
+
+  s = nested(sdsempty(), 1, 100);
+  run("array 100 x 8B", s, sdslen(s), 1, sdslen(s));
+  run("array 100 x 8B, 16B reads", s, sdslen(s), 1, 16);
+  sdsfree(s);
+  s = nested(sdsempty(), 3, 10);
+  run("nested arrays 10 x 10 x 10", s, sdslen(s), 1, sdslen(s));
+  sdsfree(s);
+  s = nested(sdsempty(), 6, 3);
+  run("nested arrays depth 6 x 3", s, sdslen(s), 1, sdslen(s));
+  sdsfree(s);
+
+  const char* message = "*3\r\n$7\r\nmessage\r\n$22\r\n__keyspace@0__:key:123\r\n$3\r\nset\r\n";
+  run("pub/sub message", message, strlen(message), 1, strlen(message));
+  s = sdsempty();
+  for (i = 0; i < 100; i++) {
+    s = sdscat(s, message);
+  }
+  run("pub/sub messages, 100 per read", s, sdslen(s), 100, sdslen(s));
+  sdsfree(s);
+  const char* pmessage = "*4\r\n$8\r\npmessage\r\n$16\r\n__keyspace@0__:*\r\n"
+                         "$22\r\n__keyspace@0__:key:123\r\n$3\r\nset\r\n";
+  run("pub/sub pmessage", pmessage, strlen(pmessage), 1, strlen(pmessage));
+
+  s = sdsempty();
+  for (i = 0; i < 1000; i++) {
+    s = sdscat(s, "+OK\r\n");
+  }
+  run("status +OK, 1000 per read", s, sdslen(s), 1000, sdslen(s));
+  sdsfree(s);
+  return 0;
+}
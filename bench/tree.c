@@ -0,0 +1,180 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 gsick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * insert / search / insert_timer / search_timer on the cb.c trees.
+ * One op is one insert or one search.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cb.h"
+#include "crazysnail.h"
+#include "bench.h"
+
+/* Sorted keys make a list of the tree, kept below */
+#define BENCH_SORTED_MAX 10000
+
+
+/* destroy_tree stops the timers, none here */
+void stop_timer(uv_timer_t* req) {
+}
+
+
+static uint64_t next_random(uint64_t* state) {
+
+  /* xorshift64 */
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+
+static void shuffle(char** keys, int n, uint64_t* state) {
+
+  int i;
+  for (i = n - 1; i > 0; i--) {
+    int j = (int)(next_random(state) % (i + 1));
+    char* tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+}
+
+
+static void run_keys(int n, bool sorted) {
+
+  char name[64];
+  uint64_t state = 88172645463325252ULL;
+  char** keys = (char**)malloc(n * sizeof(char*));
+  int i;
+  for (i = 0; i < n; i++) {
+    keys[i] = (char*)malloc(40);
+    snprintf(keys[i], 40, "__keyspace@0__:key:%08d", i);
+  }
+  if (!sorted) {
+    shuffle(keys, n, &state);
+  }
+
+  node_t* root = NULL;
+  node_t* leaf = NULL;
+  uint64_t allocs = bench_allocs;
+  uint64_t start = bench_ns();
+  for (i = 0; i < n; i++) {
+    int r = insert(&root, &leaf, keys[i]);
+    assert(r == SNAIL_OK);
+  }
+  snprintf(name, sizeof(name), "insert %d keys%s", n, sorted ? ", sorted" : "");
+  bench_report(name, n, start, allocs);
+
+  if (!sorted) {
+    shuffle(keys, n, &state);
+  }
+  allocs = bench_allocs;
+  start = bench_ns();
+  for (i = 0; i < n; i++) {
+    callback_ends_t* cb_list = NULL;
+    search(keys[i], root, &cb_list);
+    assert(cb_list != NULL);
+    bench_use(cb_list);
+  }
+  snprintf(name, sizeof(name), "search %d keys%s", n, sorted ? ", sorted" : "");
+  bench_report(name, n, start, allocs);
+
+  allocs = bench_allocs;
+  start = bench_ns();
+  for (i = 0; i < n; i++) {
+    callback_ends_t* cb_list = NULL;
+    keys[i][19] = '-';
+    search(keys[i], root, &cb_list);
+    assert(cb_list == NULL);
+  }
+  snprintf(name, sizeof(name), "search %d keys%s, missing", n, sorted ? ", sorted" : "");
+  bench_report(name, n, start, allocs);
+
+  destroy_tree(&root);
+  for (i = 0; i < n; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+}
+
+
+static void run_timers(int n) {
+
+  char name[64];
+  uint64_t state = 2463534242ULL;
+  uint64_t* keys = (uint64_t*)malloc(n * sizeof(uint64_t));
+  int i;
+  for (i = 0; i < n; i++) {
+    keys[i] = next_random(&state);
+  }
+
+  node_t* root = NULL;
+  node_t* leaf = NULL;
+  uint64_t allocs = bench_allocs;
+  uint64_t start = bench_ns();
+  for (i = 0; i < n; i++) {
+    insert_timer(&root, &leaf, keys[i]);
+  }
+  snprintf(name, sizeof(name), "insert_timer %d keys", n);
+  bench_report(name, n, start, allocs);
+
+  allocs = bench_allocs;
+  start = bench_ns();
+  for (i = 0; i < n; i++) {
+    leaf = NULL;
+    search_timer(keys[n - 1 - i], root, &leaf);
+    assert(leaf != NULL);
+    bench_use(leaf);
+  }
+  snprintf(name, sizeof(name), "search_timer %d keys", n);
+  bench_report(name, n, start, allocs);
+
+  destroy_tree(&root);
+  free(keys);
+}
+
+
+int main(void) {
+
+  int n;
+
+  printf("trees\n");
+  for (n = 1000; n <= 1000000; n *= 10) {
+    run_keys(n, false);
+  }
+  for (n = 1000; n <= BENCH_SORTED_MAX; n *= 10) {
+    run_keys(n, true);
+  }
+  for (n = 1000; n <= 1000000; n *= 10) {
+    run_timers(n);
+  }
+  return 0;
+}
@@ -0,0 +1,182 @@
+--[[
+
+The MIT License (MIT)
+
+Copyright (c) 2015 gsick
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+--]]
+
+--[[
+
+LuaJIT FFI fast path, the commands and the replies stay out of the LUA C API.
+
+  local fast = require("crazy-snail/fast")(snail)
+  fast:command(function(err, reply)
+    local value = fast.string(reply)
+  end, "get", "Key1")
+
+The reply is a `const redisReply*` only valid during the callback,
+its strings are copied into LUA strings on demand.
+
+--]]
+
+local ffi = require("ffi")
+
+ffi.cdef[[
+typedef struct redisReply {
+  int type;
+  long long integer;
+  double dval;
+  int len;
+  char *str;
+  char vtype[4];
+  size_t elements;
+  struct redisReply **element;
+} redisReply;
+
+typedef struct snail_api_s {
+  int version;
+  int (*command)(void* cc, int argc, const char** argv,
+                 const size_t* argvlen, unsigned int id);
+  const char* (*strerror)(int err);
+} snail_api_t;
+]]
+
+local API_VERSION = 1
+local MAX_ID = 4294967295
+
+local REPLY = {
+  STRING = 1,
+  ARRAY = 2,
+  INTEGER = 3,
+  NIL = 4,
+  STATUS = 5,
+  ERROR = 6,
+  DOUBLE = 7,
+  BOOL = 8,
+  MAP = 9,
+  SET = 10,
+  PUSH = 12,
+  BIGNUM = 13,
+  VERB = 14
+}
+
+local reply_ptr = ffi.typeof("const redisReply*")
+
+local Fast = {}
+Fast.__index = Fast
+Fast.REPLY = REPLY
+
+-- Copy a string reply into a LUA string, nil if none
+function Fast.string(reply)
+  if reply.str == nil then
+    return nil
+  end
+  return ffi.string(reply.str, reply.len)
+end
+
+-- Element of an aggregate reply, from 1
+function Fast.element(reply, i)
+  if i < 1 or i > tonumber(reply.elements) then
+    return nil
+  end
+  return reply.element[i - 1]
+end
+
+local function grow(self, size)
+  while self.size < size do
+    self.size = self.size * 2
+  end
+  self.argv = ffi.new("const char*[?]", self.size)
+  self.argvlen = ffi.new("size_t[?]", self.size)
+end
+
+-- Execute a Redis command, return false when a high-water mark is exceeded
+function Fast:command(callback, ...)
+  local argc = select("#", ...)
+  if argc > self.size then
+    grow(self, argc)
+  end
+
+  local argv, argvlen, anchors = self.argv, self.argvlen, self.anchors
+  for i = 1, argc do
+    local arg = select(i, ...)
+    if type(arg) ~= "string" then
+      arg = tostring(arg)
+      -- Keep it alive until the command is formatted
+      anchors[i] = arg
+    end
+    argv[i - 1] = arg
+    argvlen[i - 1] = #arg
+  end
+
+  local id = self.id
+  self.id = id < MAX_ID and id + 1 or 0
+
+  local r = self.api.command(self.cc, argc, argv, argvlen, id)
+  for i = 1, argc do
+    anchors[i] = nil
+  end
+  if r < 0 then
+    error("command: " .. ffi.string(self.api.strerror(r)), 2)
+  end
+
+  self.callbacks[id] = callback
+  return r == 0
+end
+
+return function(snail)
+  local cc, api = snail:ffi()
+  api = ffi.cast("const snail_api_t*", api)
+  if api.version ~= API_VERSION then
+    error("ffi: API version " .. api.version .. " expected " .. API_VERSION)
+  end
+
+  local self = setmetatable({
+    cc = cc,
+    api = api,
+    id = 0,
+    size = 64,
+    callbacks = {},
+    anchors = {}
+  }, Fast)
+  grow(self, self.size)
+
+  local callbacks = self.callbacks
+  snail:on("reply", function(id, reply, err)
+    local callback = callbacks[id]
+    callbacks[id] = nil
+    if callback == nil then
+      return
+    end
+    if reply == nil then
+      callback(err)
+      return
+    end
+    reply = ffi.cast(reply_ptr, reply)
+    if reply.type == REPLY.ERROR then
+      callback(ffi.string(reply.str, reply.len))
+    else
+      callback(nil, reply)
+    end
+  end)
+
+  return self
+end
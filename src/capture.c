@@ -0,0 +1,270 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 gsick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uv.h"
+#include "capture.h"
+
+/* Records waiting for the writer thread, first size and bound */
+#define CAPTURE_CHUNK (64 * 1024)
+#define CAPTURE_QUEUE (64 << 20)
+
+
+static void put_le(unsigned char* p, uint64_t value, int size) {
+
+  int i;
+  for (i = 0; i < size; i++) {
+    p[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+
+static uint64_t get_le(const unsigned char* p, int size) {
+
+  uint64_t value = 0;
+  int i;
+  for (i = size - 1; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+
+static int create_capture(capture_t** capture, const char* path,
+                          const char* mode) {
+
+  assert(*capture == NULL);
+
+  capture_t* c = (capture_t*)malloc(sizeof(capture_t));
+  if (c == NULL) {
+    return UV_ENOMEM;
+  }
+  c->file = fopen(path, mode);
+  if (c->file == NULL) {
+    int r = -errno;
+    free(c);
+    return r;
+  }
+  c->start = uv_hrtime();
+  c->buf = NULL;
+  c->size = 0;
+  c->writer = false;
+  c->pending = NULL;
+  c->pending_len = 0;
+  c->pending_size = 0;
+  c->closing = false;
+  c->error = 0;
+  *capture = c;
+  return 0;
+}
+
+
+/* Writer thread, the file is written out of the loop */
+static void capture_writer(void* arg) {
+
+  capture_t* c = (capture_t*)arg;
+  char* writing = NULL;
+  size_t writing_size = 0;
+
+  uv_mutex_lock(&c->lock);
+  for (;;) {
+    while (c->pending_len == 0 && !c->closing) {
+      uv_cond_wait(&c->cond, &c->lock);
+    }
+    /* Closed and drained */
+    if (c->pending_len == 0) {
+      break;
+    }
+
+    /* Swap the buffers, the loop fills the other one meanwhile */
+    char* buf = c->pending;
+    size_t size = c->pending_size;
+    size_t len = c->pending_len;
+    c->pending = writing;
+    c->pending_size = writing_size;
+    c->pending_len = 0;
+    writing = buf;
+    writing_size = size;
+    uv_mutex_unlock(&c->lock);
+
+    bool ok = (fwrite(writing, 1, len, c->file) == len);
+
+    uv_mutex_lock(&c->lock);
+    if (!ok && c->error == 0) {
+      c->error = UV_EIO;
+    }
+  }
+  uv_mutex_unlock(&c->lock);
+  free(writing);
+}
+
+
+int capture_open(capture_t** capture, const char* path) {
+
+  int r = create_capture(capture, path, "wb");
+  if (r < 0) {
+    return r;
+  }
+  capture_t* c = *capture;
+  if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, c->file) != CAPTURE_MAGIC_LEN) {
+    capture_close(capture);
+    return UV_EIO;
+  }
+
+  if ((r = uv_mutex_init(&c->lock)) < 0) {
+    capture_close(capture);
+    return r;
+  }
+  if ((r = uv_cond_init(&c->cond)) < 0) {
+    uv_mutex_destroy(&c->lock);
+    capture_close(capture);
+    return r;
+  }
+  if ((r = uv_thread_create(&c->thread, capture_writer, c)) < 0) {
+    uv_cond_destroy(&c->cond);
+    uv_mutex_destroy(&c->lock);
+    capture_close(capture);
+    return r;
+  }
+  c->writer = true;
+  return 0;
+}
+
+
+int capture_write(capture_t* capture, int dir, int stream,
+                  const char* buf, size_t len) {
+
+  assert(capture != NULL && capture->writer);
+
+  unsigned char header[CAPTURE_HEADER_LEN];
+  put_le(header, uv_hrtime() - capture->start, 8);
+  put_le(header + 8, len, 4);
+  header[12] = (unsigned char)dir;
+  header[13] = (unsigned char)stream;
+
+  uv_mutex_lock(&capture->lock);
+  int r = capture->error;
+  size_t need = capture->pending_len + CAPTURE_HEADER_LEN + len;
+
+  if (r == 0 && need > CAPTURE_QUEUE) {
+    /* The disk does not keep up, a partial capture could not be replayed */
+    r = UV_ENOBUFS;
+  } else if (r == 0 && need > capture->pending_size) {
+    size_t size = capture->pending_size > 0 ? capture->pending_size : CAPTURE_CHUNK;
+    while (size < need) {
+      size *= 2;
+    }
+    char* pending = (char*)realloc(capture->pending, size);
+    if (pending == NULL) {
+      r = UV_ENOMEM;
+    } else {
+      capture->pending = pending;
+      capture->pending_size = size;
+    }
+  }
+
+  if (r == 0) {
+    char* p = capture->pending + capture->pending_len;
+    memcpy(p, header, CAPTURE_HEADER_LEN);
+    memcpy(p + CAPTURE_HEADER_LEN, buf, len);
+    capture->pending_len = need;
+    uv_cond_signal(&capture->cond);
+  }
+  uv_mutex_unlock(&capture->lock);
+  return r;
+}
+
+
+int capture_load(capture_t** capture, const char* path) {
+
+  int r = create_capture(capture, path, "rb");
+  if (r < 0) {
+    return r;
+  }
+  char magic[CAPTURE_MAGIC_LEN];
+  if (fread(magic, 1, CAPTURE_MAGIC_LEN, (*capture)->file) != CAPTURE_MAGIC_LEN
+      || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+    capture_close(capture);
+    return UV_EINVAL;
+  }
+  return 0;
+}
+
+
+int capture_next(capture_t* capture, capture_record_t* record) {
+
+  assert(capture != NULL);
+
+  unsigned char header[CAPTURE_HEADER_LEN];
+  size_t n = fread(header, 1, CAPTURE_HEADER_LEN, capture->file);
+  if (n == 0 && feof(capture->file)) {
+    return 0;
+  }
+  if (n != CAPTURE_HEADER_LEN) {
+    return UV_EIO;
+  }
+  record->time = get_le(header, 8);
+  record->len = (uint32_t)get_le(header + 8, 4);
+  record->dir = header[12];
+  record->stream = header[13];
+
+  if (record->len > capture->size) {
+    char* buf = (char*)realloc(capture->buf, record->len);
+    if (buf == NULL) {
+      return UV_ENOMEM;
+    }
+    capture->buf = buf;
+    capture->size = record->len;
+  }
+  if (fread(capture->buf, 1, record->len, capture->file) != record->len) {
+    return UV_EIO;
+  }
+  return 1;
+}
+
+
+void capture_close(capture_t** capture) {
+
+  if (*capture == NULL) {
+    return;
+  }
+  capture_t* c = *capture;
+  if (c->writer) {
+    /* The thread writes what is left then exits */
+    uv_mutex_lock(&c->lock);
+    c->closing = true;
+    uv_cond_signal(&c->cond);
+    uv_mutex_unlock(&c->lock);
+    uv_thread_join(&c->thread);
+    uv_cond_destroy(&c->cond);
+    uv_mutex_destroy(&c->lock);
+    free(c->pending);
+  }
+  fclose(c->file);
+  free(c->buf);
+  free(c);
+  *capture = NULL;
+}
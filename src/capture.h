@@ -0,0 +1,83 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 gsick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "uv.h"
+
+/* Capture file: the magic then one record per read or write,
+ * a 14 bytes little-endian header followed by the bytes
+ *   time (u64, ns since the capture start), len (u32), dir (u8), stream (u8) */
+#define CAPTURE_MAGIC "SNAILCP1"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_HEADER_LEN 14
+
+/* Direction */
+#define CAPTURE_READ 0
+#define CAPTURE_WRITE 1
+
+/* Stream */
+#define CAPTURE_STREAM 0
+#define CAPTURE_SUB_STREAM 1
+
+typedef struct capture_record_s {
+  uint64_t time;
+  uint32_t len;
+  uint8_t dir;
+  uint8_t stream;
+} capture_record_t;
+
+typedef struct capture_s {
+  FILE* file;
+  uint64_t start;
+  /* Record data, replay side */
+  char* buf;
+  size_t size;
+  /* Capture side, the loop appends the records to pending,
+   * the writer thread takes it and writes it out */
+  bool writer;
+  uv_thread_t thread;
+  uv_mutex_t lock;
+  uv_cond_t cond;
+  char* pending;
+  size_t pending_len;
+  size_t pending_size;
+  bool closing;
+  int error;
+} capture_t;
+
+/* 0 or a UV error (-errno) */
+int capture_open(capture_t** capture, const char* path);
+/* Copy the record for the writer thread, UV_ENOBUFS when it is too far behind */
+int capture_write(capture_t* capture, int dir, int stream,
+                  const char* buf, size_t len);
+int capture_load(capture_t** capture, const char* path);
+/* 1 and the record data in capture->buf, 0 at the end, a UV error otherwise */
+int capture_next(capture_t* capture, capture_record_t* record);
+void capture_close(capture_t** capture);
+
+#endif
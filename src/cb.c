@@ -104,8 +104,16 @@ int create_callback(callback_t** callback, int ref, int nb_channel) {
     return SNAIL_ERR;
   }
   (*callback)->ref = ref;
+  (*callback)->flags = 0;
   (*callback)->nb_channel = nb_channel;
   (*callback)->attach = 0;
+  (*callback)->deadline = 0;
+  (*callback)->children = NULL;
+  (*callback)->key = NULL;
+  (*callback)->fn = NULL;
+  (*callback)->data = NULL;
+  (*callback)->hist = NULL;
+  (*callback)->start = 0;
   (*callback)->channels = (channel_t**)calloc(nb_channel, sizeof(channel_t*));
   if ((*callback)->channels == NULL) {
     return SNAIL_ERR;
@@ -123,11 +131,52 @@ void destroy_callback(callback_t* callback) {
     destroy_channel(callback->channels[i]);
   }
   free(callback->channels);
+  if (callback->children != NULL) {
+    destroy_list(&callback->children);
+    free(callback->children);
+  }
+  if (callback->key != NULL) {
+    free(callback->key);
+  }
   free(callback);
   callback = NULL;
 }
 
 
+void release_callback(callback_t* callback) {
+  assert(callback != NULL);
+
+  if (callback->attach <= 1) {
+    destroy_callback(callback);
+  } else {
+    callback->attach--;
+  }
+}
+
+
+int add_child(callback_t* parent, callback_t* child) {
+  assert(parent != NULL);
+  assert(child != NULL);
+
+  if (parent->children == NULL) {
+    parent->children = (callback_ends_t*)malloc(sizeof(callback_ends_t));
+    if (parent->children == NULL) {
+      return SNAIL_ERR;
+    }
+    parent->children->head = NULL;
+    parent->children->tail = NULL;
+  }
+
+  callback_ll_t* wrapper = NULL;
+  if (wrap_cb(&wrapper, child) != 0) {
+    return SNAIL_ERR;
+  }
+  push_cb(&parent->children, wrapper);
+
+  return SNAIL_OK;
+}
+
+
 int create_channel(channel_t** channel, const char* name) {
   assert(*channel == NULL);
   
@@ -175,8 +224,6 @@ void destroy_channel(channel_t* channel) {
 
 int insert(node_t **root, node_t **leaf, const char* key) {
 
-  int len = strlen(key);
-
   if (*root == NULL) { 
     *root = (node_t*)malloc(sizeof(node_t));
     if (*root == NULL) {
@@ -192,10 +239,12 @@ int insert(node_t **root, node_t **leaf, const char* key) {
     (*root)->cb_list->head = NULL;
     (*root)->cb_list->tail = NULL;
     (*root)->data = NULL;
+    (*root)->calls = 0;
+    (*root)->busy = 0;
     *leaf = *root;
-  } else if (strncmp(key, (*root)->key, len) < 0) {
+  } else if (strcmp(key, (*root)->key) < 0) {
     return insert(&(*root)->left, &(*leaf), key);
-  } else if (strncmp(key, (*root)->key, len) > 0) {
+  } else if (strcmp(key, (*root)->key) > 0) {
     return insert(&(*root)->right, &(*leaf), key);
   } else {
     *leaf = *root;
@@ -229,6 +278,52 @@ void destroy_tree(node_t **root) {
 }
 
 
+int delete_node(node_t **root, const char* key) {
+
+  if (*root == NULL) {
+    return SNAIL_ERR;
+  }
+
+  int cmp = strcmp(key, (*root)->key);
+  if (cmp < 0) {
+    return delete_node(&(*root)->left, key);
+  } else if (cmp > 0) {
+    return delete_node(&(*root)->right, key);
+  }
+
+  node_t *node = *root;
+  if (node->left != NULL && node->right != NULL) {
+    /* Swap with the smallest key of the right subtree */
+    node_t **min = &node->right;
+    while ((*min)->left != NULL) {
+      min = &(*min)->left;
+    }
+    char* temp_key = node->key;
+    callback_ends_t* temp_list = node->cb_list;
+    uint64_t temp_calls = node->calls;
+    uint64_t temp_busy = node->busy;
+    node->key = (*min)->key;
+    node->cb_list = (*min)->cb_list;
+    node->calls = (*min)->calls;
+    node->busy = (*min)->busy;
+    (*min)->key = temp_key;
+    (*min)->cb_list = temp_list;
+    (*min)->calls = temp_calls;
+    (*min)->busy = temp_busy;
+    root = min;
+    node = *min;
+  }
+  *root = node->left != NULL ? node->left : node->right;
+
+  free(node->key);
+  destroy_list(&node->cb_list);
+  free(node->cb_list);
+  free(node);
+
+  return SNAIL_OK;
+}
+
+
 void destroy_list(callback_ends_t **cb_list) {
   if (cb_list == NULL || (*cb_list) == NULL) {
     return;
@@ -246,12 +341,15 @@ void destroy_list(callback_ends_t **cb_list) {
 
 
 void search(const char* key, node_t *leaf, callback_ends_t** cb_list) {
-  assert(leaf != NULL);
+  /* Not found */
+  if (leaf == NULL) {
+    return;
+  }
 
-  int len = strlen(key);
-  if (strncmp(key, leaf->key, len) == 0) {
+  int cmp = strcmp(key, leaf->key);
+  if (cmp == 0) {
     *cb_list = leaf->cb_list;
-  } else if (strncmp(key, leaf->key, len) < 0) {
+  } else if (cmp < 0) {
     search(key, leaf->left, cb_list);
   } else {
     search(key, leaf->right, cb_list);
@@ -259,6 +357,23 @@ void search(const char* key, node_t *leaf, callback_ends_t** cb_list) {
 }
 
 
+void search_node(const char* key, node_t *root, node_t** leaf) {
+  /* Not found */
+  if (root == NULL) {
+    return;
+  }
+
+  int cmp = strcmp(key, root->key);
+  if (cmp == 0) {
+    *leaf = root;
+  } else if (cmp < 0) {
+    search_node(key, root->left, leaf);
+  } else {
+    search_node(key, root->right, leaf);
+  }
+}
+
+
 int insert_timer(node_t **root, node_t **leaf, uint64_t key) {
 
   if (*root == NULL) { 
@@ -277,6 +392,8 @@ int insert_timer(node_t **root, node_t **leaf, uint64_t key) {
     (*root)->cb_list->head = NULL;
     (*root)->cb_list->tail = NULL;
     (*root)->data = NULL;
+    (*root)->calls = 0;
+    (*root)->busy = 0;
     *leaf = *root;
     
     return 2;
@@ -304,6 +421,130 @@ void search_timer(uint64_t key, node_t *root, node_t** leaf) {
 }
 
 
+int create_wheel(wheel_t** wheel, uint64_t resolution, uint64_t now) {
+  assert(*wheel == NULL);
+  assert(resolution > 0);
+
+  *wheel = (wheel_t*)calloc(1, sizeof(wheel_t));
+  if (*wheel == NULL) {
+    return SNAIL_ERR;
+  }
+  (*wheel)->resolution = resolution;
+  (*wheel)->tick = now / resolution;
+  (*wheel)->count = 0;
+
+  int i;
+  for (i = 0; i < WHEEL_SLOTS; i++) {
+    (*wheel)->slots[i] = (callback_ends_t*)malloc(sizeof(callback_ends_t));
+    if ((*wheel)->slots[i] == NULL) {
+      destroy_wheel(wheel);
+      return SNAIL_ERR;
+    }
+    (*wheel)->slots[i]->head = NULL;
+    (*wheel)->slots[i]->tail = NULL;
+  }
+
+  return SNAIL_OK;
+}
+
+
+void destroy_wheel(wheel_t** wheel) {
+  if (wheel == NULL || (*wheel) == NULL) {
+    return;
+  }
+  int i;
+  for (i = 0; i < WHEEL_SLOTS; i++) {
+    if ((*wheel)->slots[i] != NULL) {
+      destroy_list(&(*wheel)->slots[i]);
+      free((*wheel)->slots[i]);
+    }
+  }
+  free(*wheel);
+  *wheel = NULL;
+}
+
+
+int wheel_add(wheel_t* wheel, callback_t* cb) {
+  assert(wheel != NULL);
+  assert(cb->deadline > 0);
+
+  /* Rounded up, the slot is swept once the deadline is reached */
+  uint64_t tick = (cb->deadline + wheel->resolution - 1) / wheel->resolution;
+  /* Already due, it will be swept on the next tick */
+  if (tick <= wheel->tick) {
+    tick = wheel->tick + 1;
+  }
+
+  callback_ll_t* wrapper = NULL;
+  if (wrap_cb(&wrapper, cb) != 0) {
+    return SNAIL_ERR;
+  }
+  push_cb(&wheel->slots[tick % WHEEL_SLOTS], wrapper);
+  wheel->count++;
+
+  return SNAIL_OK;
+}
+
+
+void wheel_sweep(wheel_t* wheel, uint64_t now,
+                 void (*expire)(callback_t* cb, void* data), void* data) {
+  assert(wheel != NULL);
+
+  uint64_t target = now / wheel->resolution;
+  uint64_t steps = target > wheel->tick ? target - wheel->tick : 0;
+  /* Late by more than one revolution, every slot is swept once */
+  if (steps > WHEEL_SLOTS) {
+    steps = WHEEL_SLOTS;
+  }
+
+  uint64_t i;
+  for (i = 1; i <= steps; i++) {
+    callback_ends_t* slot = wheel->slots[(wheel->tick + i) % WHEEL_SLOTS];
+    /* Detach the slot, expire may add new callbacks in it */
+    callback_ll_t* temp = slot->head;
+    slot->head = NULL;
+    slot->tail = NULL;
+
+    while (temp != NULL) {
+      callback_ll_t* next = temp->next;
+      callback_t* cb = temp->cb;
+      temp->next = NULL;
+
+      if (!(cb->flags & CALLBACK_DONE) && cb->deadline > now) {
+        /* Next revolution, keep it */
+        if (slot->head == NULL)
+          slot->head = temp;
+        if (slot->tail != NULL)
+          slot->tail->next = temp;
+        slot->tail = temp;
+      } else {
+        if (!(cb->flags & CALLBACK_DONE)) {
+          expire(cb, data);
+        }
+        destroy_wrapper(&temp);
+        wheel->count--;
+      }
+      temp = next;
+    }
+  }
+  if (target > wheel->tick) {
+    wheel->tick = target;
+  }
+}
+
+
+void walk_tree(node_t* node, void (*fn)(node_t* node, void* data), void* data) {
+
+  if (node == NULL) {
+    return;
+  }
+
+  walk_tree(node->left, fn, data);
+  fn(node, data);
+  walk_tree(node->right, fn, data);
+}
+
+
 void dump_tree(node_t* node) {
   
   if (node == NULL) {
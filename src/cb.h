@@ -37,6 +37,15 @@
 
 /* State of the callback */
 #define CALLBACK_INITIALIZED 0x1
+/* Reply has been received */
+#define CALLBACK_DONE 0x2
+/* Deadline has been reached before the reply */
+#define CALLBACK_TIMED_OUT 0x4
+/* Reply is an array to split between the children */
+#define CALLBACK_BATCH 0x8
+
+/* Number of slots of the timeout wheel */
+#define WHEEL_SLOTS 256
 
 /* Channel type */
 typedef struct channel_s {
@@ -45,6 +54,13 @@ typedef struct channel_s {
   int flags;
 } channel_t;
 
+struct callback_s;
+struct histogram_s;
+
+/* C reply handler, called instead of the LUA callback
+ * with either a reply or an error */
+typedef void (*reply_fn)(void* ctx, struct callback_s* cb, void* reply, const char* error);
+
 /* Callback type */
 typedef struct callback_s {
   /* LUA callback function ref */
@@ -53,6 +69,18 @@ typedef struct callback_s {
   int nb_channel;
   int attach;
   channel_t **channels;
+  /* Timeout deadline in ms (loop time), 0 if none */
+  uint64_t deadline;
+  /* Callbacks completed by this one's reply */
+  struct callback_ends_s *children;
+  /* In flight command shared with the children */
+  char* key;
+  /* C reply handler and its data */
+  reply_fn fn;
+  void* data;
+  /* Latency histogram of the command and send time (ns) */
+  struct histogram_s* hist;
+  uint64_t start;
 } callback_t;
 
 /* Simple linked list */
@@ -66,6 +94,17 @@ typedef struct callback_ends_s {
   callback_ll_t *head, *tail;
 } callback_ends_t;
 
+/* Hashed timing wheel of callbacks with a deadline */
+typedef struct wheel_s {
+  /* Width of a slot in ms */
+  uint64_t resolution;
+  /* Last swept tick */
+  uint64_t tick;
+  /* Number of callbacks in the wheel */
+  int count;
+  callback_ends_t* slots[WHEEL_SLOTS];
+} wheel_t;
+
 /* Tree node */
 typedef struct node_s {
   char* key;
@@ -75,10 +114,15 @@ typedef struct node_s {
   callback_ends_t* cb_list;
   /* Timer */
   void* data;
+  /* LUA calls of the subscription and their total time (ns) */
+  uint64_t calls;
+  uint64_t busy;
 } node_t;
 
 int create_callback(callback_t** callback, int ref, int nb_channel);
 void destroy_callback(callback_t* callback);
+void release_callback(callback_t* callback);
+int add_child(callback_t* parent, callback_t* child);
 int create_channel(channel_t** channel, const char* name);
 void destroy_channel(channel_t* channel);
 int create_timer_channel(channel_t** channel, uint64_t ikey);
@@ -86,6 +130,9 @@ int create_timer_channel(channel_t** channel, uint64_t ikey);
 int insert(node_t **root, node_t **leaf, const char* key);
 void destroy_tree(node_t **root);
 void search(const char* key, node_t *leaf, callback_ends_t** cb_list);
+void search_node(const char* key, node_t *root, node_t** leaf);
+int delete_node(node_t **root, const char* key);
+void walk_tree(node_t* node, void (*fn)(node_t* node, void* data), void* data);
 
 int insert_timer(node_t **root, node_t **leaf, uint64_t key);
 void search_timer(uint64_t key, node_t *root, node_t** leaf);
@@ -99,4 +146,10 @@ int wrap_cb(callback_ll_t** wrapper, callback_t* cb);
 void push_cb(callback_ends_t** list, callback_ll_t* source);
 int shift_cb(callback_ends_t** list, callback_t* target);
 
+int create_wheel(wheel_t** wheel, uint64_t resolution, uint64_t now);
+void destroy_wheel(wheel_t** wheel);
+int wheel_add(wheel_t* wheel, callback_t* cb);
+void wheel_sweep(wheel_t* wheel, uint64_t now,
+                 void (*expire)(callback_t* cb, void* data), void* data);
+
 #endif
@@ -33,25 +33,41 @@
 #include <lauxlib.h>
 #include <math.h>
 #include <signal.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "uv.h"
 #include "cb.h"
 #include "crazysnail.h"
 #include "hiredis-light.h"
+#include "probes.h"
 #include "sds.h"
 
 #define LUA_CLIENT_MT "lua.crazy.snail.client"
+#define LUA_JOIN_MT "lua.crazy.snail.join"
+#define LUA_REPLY_MT "lua.crazy.snail.reply"
+#define LUA_HISTOGRAM_MT "lua.crazy.snail.histogram"
+/* Samples backfilled by one histogram record */
+#define HIST_BACKFILL 100000
 #define LUA_MAX_STACK (LUAI_MAXCSTACK)
 
 #define KEY_EVENT "__keyevent@0__:"
 #define KEY_SPACE "__keyspace@0__:"
 #define TIMER_EVENT "__timer@0__:"
+#define INVALIDATE_CHANNEL "__redis__:invalidate"
+#define KEY_SPACE_ANY "__keyspace@"
+#define KEY_EVENT_ANY "__keyevent@"
+#define CANARY_PREFIX "__crazysnail_canary__:"
+
+/* notify-keyspace-events classes, in canonical order */
+#define NOTIFY_CLASSES "g$lshzxet"
 
 #define NB_EVENTS 35
+#define NB_READ_ONLY 34
 
 static char *events[] = {
 	"append", "del",
@@ -65,6 +81,18 @@ static char *events[] = {
 	"zadd", "zincr", "zinterstore", "zrem", "zrembyrank",
   "zrembyscore", "zunionstore"};
 
+/* Commands shared by single-flight */
+static char *read_only[] = {
+  "bitcount", "dbsize", "exists",
+  "get", "getbit", "getrange",
+  "hexists", "hget", "hgetall", "hkeys", "hlen", "hmget", "hstrlen", "hvals",
+  "lindex", "llen", "lrange",
+  "mget", "pfcount", "pttl",
+  "scard", "sismember", "smembers", "strlen",
+  "ttl", "type",
+  "xlen", "xrange",
+  "zcard", "zcount", "zrange", "zrangebyscore", "zrank", "zscore"};
+
 static req_list_t* req_freelist = NULL;
 static buf_list_t* buf_freelist = NULL;
 
@@ -78,7 +106,13 @@ static void stackDump(lua_State *L);
 static void on_disconnect(uv_handle_t* handle);
 static int push_reply(lua_State *L, redisReply *redisReply);
 static int push_sub_reply(lua_State *L, redisReply *redisReply);
+static void complete_callback(client_context_t* cc, callback_t* cb,
+                              redisReply *reply, const char* error);
 static void on_timer(uv_timer_t* handle);
+static void on_wheel_timer(uv_timer_t* handle);
+static void on_write(uv_write_t* handle, int status);
+static void dispatch_invalidation(client_context_t* cc, redisReply* keys);
+static void emit_error(client_context_t* cc, const char* error);
 
 /* Pushes an error object onto the stack */
 void luv_push_async_error_raw(lua_State* L, const char *code, const char *msg, const char* source, const char* path) {
@@ -99,10 +133,84 @@ void luv_push_async_error_raw(lua_State* L, const char *code, const char *msg, c
   lua_setfield(L, -2, "source");
 }
 
+/* Call the slow callback with (name, ms) */
+static void emit_slow(client_context_t* cc, const char* name, uint64_t elapsed) {
+
+  if (cc->r_slow_cb != LUA_NOREF && cc->r_slow_cb != LUA_REFNIL) {
+    lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_slow_cb);
+    lua_pushstring(cc->L, name);
+    lua_pushnumber(cc->L, elapsed / 1e6);
+    lua_pcall(cc->L, 2, 0, 0);
+  }
+}
+
+
+/* Time of a LUA callback for the stats, the probe and the slow event,
+ * node is the subscription of the callback if any */
+static void account_dispatch(client_context_t* cc, node_t* node,
+                             const char* name, uint64_t elapsed) {
+
+  hist_record(&cc->stats.dispatch, elapsed / 1000);
+  SNAIL_PROBE3(dispatch, cc, name, elapsed);
+  if (node != NULL) {
+    node->calls++;
+    node->busy += elapsed;
+  }
+  if (cc->slow_callback_ns > 0 && elapsed >= cc->slow_callback_ns) {
+    cc->stats.slow++;
+    emit_slow(cc, name, elapsed);
+  }
+}
+
+
+/* lua_pcall of a LUA callback, timed, see account_dispatch */
+static int timed_pcall(client_context_t* cc, int nargs, node_t* node,
+                       const char* name) {
+
+  uint64_t start = uv_hrtime();
+  int status = lua_pcall(cc->L, nargs, 0, 0);
+  account_dispatch(cc, node, name, uv_hrtime() - start);
+  return status;
+}
+
+
+/* lua_resume of a coroutine waiting for a reply, timed as timed_pcall */
+static int timed_resume(client_context_t* cc, lua_State *co, int nargs,
+                        const char* name) {
+
+  uint64_t start = uv_hrtime();
+  int status = lua_resume(co, nargs);
+  account_dispatch(cc, NULL, name, uv_hrtime() - start);
+  return status;
+}
+
+
+/* Start the timer of a timer channel */
+static void start_timer_channel(client_context_t* cc, channel_t* ch) {
+
+  node_t* leaf = NULL;
+  /* Get the uv loop */
+  uv_loop_t* loop;
+  lua_pushstring(cc->L, "uv_loop");
+  lua_rawget(cc->L, LUA_REGISTRYINDEX);
+  loop = lua_touserdata(cc->L, -1);
+  lua_pop(cc->L, 1);
+  /* Start timer */
+  search_timer(ch->ikey, cc->timers, &leaf);
+  uv_timer_t* timer_req = (uv_timer_t*)req_alloc();
+  timer_req->data = cc;
+  int r = uv_timer_init(loop, timer_req);
+  assert(r == 0);
+  r = uv_timer_start(timer_req, on_timer, 0, ch->ikey);
+  assert(r == 0);
+  ch->flags |= CHANNEL_SUBSCRIBED;
+  leaf->data = timer_req;
+}
+
+
 static int get_and_call_sub_cb(client_context_t* cc, redisReply *reply) {
 
   callback_ends_t* cb_list = NULL;
-  node_t* leaf = NULL;
   node_t *callbacks;
   bool pvariant;
   char *stype;
@@ -110,10 +218,27 @@ static int get_and_call_sub_cb(client_context_t* cc, redisReply *reply) {
 
   /* Custom reply functions are not supported for pub/sub. This will fail
    * very hard when they are used... */
-  if (reply->type == REDIS_REPLY_ARRAY) {
+  if (reply->type == REDIS_REPLY_ARRAY || reply->type == REDIS_REPLY_PUSH) {
     assert(reply->elements >= 2);
     assert(reply->element[0]->type == REDIS_REPLY_STRING);
     stype = reply->element[0]->str;
+
+    /* Server-assisted invalidation, RESP3 push or RESP2 redirect */
+    if (strcmp(stype, "invalidate") == 0) {
+      dispatch_invalidation(cc, reply->element[1]);
+      return REDIS_OK;
+    }
+    if (strcmp(stype, "message") == 0 && reply->elements >= 3
+        && reply->element[1]->type == REDIS_REPLY_STRING
+        && strcmp(reply->element[1]->str, INVALIDATE_CHANNEL) == 0) {
+      dispatch_invalidation(cc, reply->element[2]);
+      return REDIS_OK;
+    }
+
+    /* Other RESP3 push types are not channel messages */
+    if (reply->element[1]->type != REDIS_REPLY_STRING) {
+      return REDIS_OK;
+    }
     pvariant = (tolower(stype[0]) == 'p');
 
     if (pvariant)
@@ -123,12 +248,19 @@ static int get_and_call_sub_cb(client_context_t* cc, redisReply *reply) {
 
     int unsub = strcmp(pvariant ? stype + 1 : stype, "unsubscribe");
     if(unsub == 0)
-      return; // for now
+      return REDIS_OK; // for now
 
     /* Locate the right list callback */
     assert(reply->element[1]->type == REDIS_REPLY_STRING);
     sname = sdsnewlen(reply->element[1]->str,reply->element[1]->len);
-    search(sname, callbacks, &cb_list);
+    SNAIL_PROBE3(message, cc, sname, stype);
+    node_t* node = NULL;
+    search_node(sname, callbacks, &node);
+    if (node == NULL) {
+      sdsfree(sname);
+      return REDIS_OK;
+    }
+    cb_list = node->cb_list;
 
     /* Set flags */
     callback_ll_t *temp = cb_list->head;
@@ -154,21 +286,7 @@ static int get_and_call_sub_cb(client_context_t* cc, redisReply *reply) {
 			          ch->flags |= CHANNEL_SUBSCRIBED;
 				        done = 1;
 			        } else if ((ch->flags & CHANNEL_TIMER_EVENT)) {
-								/* Get the uv loop */
-								uv_loop_t* loop;
-								lua_pushstring(cc->L, "uv_loop");
-								lua_rawget(cc->L, LUA_REGISTRYINDEX);
-								loop = lua_touserdata(cc->L, -1);
-                /* Start timer */
-                search_timer(ch->ikey, cc->timers, &leaf);
-                uv_timer_t* timer_req = (uv_timer_t*)req_alloc();
-                timer_req->data = cc;
-                int r = uv_timer_init(loop, timer_req);
-								assert(r == 0);
-                r = uv_timer_start(timer_req, on_timer, 0, ch->ikey);
-								assert(r == 0);
-                ch->flags |= CHANNEL_SUBSCRIBED;
-                leaf->data = timer_req;
+                start_timer_channel(cc, ch);
               }
             }
 
@@ -186,7 +304,7 @@ static int get_and_call_sub_cb(client_context_t* cc, redisReply *reply) {
 
             lua_pushnil(L);
             int argc = push_sub_reply(L, reply);
-            lua_pcall(cc->L, argc + 1, 0, 0);
+            timed_pcall(cc, argc + 1, node, sname);
 			    }
         }
         temp = temp->next;
@@ -194,6 +312,13 @@ static int get_and_call_sub_cb(client_context_t* cc, redisReply *reply) {
     } else {
      while(temp != NULL) {
 
+        /* Rule, no LUA */
+        if (temp->cb->fn != NULL) {
+          temp->cb->fn(cc, temp->cb, reply, NULL);
+          temp = temp->next;
+          continue;
+        }
+
         lua_State *L = cc->L;
         lua_rawgeti(L, LUA_REGISTRYINDEX, temp->cb->ref);
 
@@ -203,7 +328,7 @@ static int get_and_call_sub_cb(client_context_t* cc, redisReply *reply) {
 			  } else {
           lua_pushnil(L);
           int argc = push_sub_reply(L, reply);
-          lua_pcall(cc->L, argc + 1, 0, 0);
+          timed_pcall(cc, argc + 1, node, sname);
         }
         temp = temp->next;
      }
@@ -272,7 +397,8 @@ static int push_sub_reply(lua_State *L, redisReply *redisReply) {
       break;
     }
 
-    case REDIS_REPLY_ARRAY: {
+    case REDIS_REPLY_ARRAY:
+    case REDIS_REPLY_PUSH: {
       unsigned int i;
       lua_createtable(L, redisReply->elements, 0);
 
@@ -311,10 +437,22 @@ static int push_reply(lua_State *L, redisReply *redisReply) {
       break;
 
     case REDIS_REPLY_STRING:
+    case REDIS_REPLY_VERB:
+    case REDIS_REPLY_BIGNUM:
       lua_pushlstring(L, redisReply->str, redisReply->len);
       break;
 
-    case REDIS_REPLY_ARRAY: {
+    case REDIS_REPLY_DOUBLE:
+      lua_pushnumber(L, redisReply->dval);
+      break;
+
+    case REDIS_REPLY_BOOL:
+      lua_pushboolean(L, redisReply->integer);
+      break;
+
+    case REDIS_REPLY_ARRAY:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_PUSH: {
       unsigned int i;
       lua_createtable(L, redisReply->elements, 0);
 
@@ -326,6 +464,19 @@ static int push_reply(lua_State *L, redisReply *redisReply) {
       break;
     }
 
+    case REDIS_REPLY_MAP: {
+      unsigned int i;
+      lua_createtable(L, 0, redisReply->elements / 2);
+
+      for (i = 0; i + 1 < redisReply->elements; i += 2) {
+        push_reply(L, redisReply->element[i]);
+        push_reply(L, redisReply->element[i + 1]);
+        lua_rawset(L, -3); /* Store key and value */
+      }
+
+      break;
+    }
+
     default:
       return luaL_error(L, "Unknown reply type: %d", redisReply->type);
   }
@@ -333,514 +484,4172 @@ static int push_reply(lua_State *L, redisReply *redisReply) {
   return 1;
 }
 
-static void on_timer(uv_timer_t* handle) {
 
-  client_context_t* cc = (client_context_t*)handle->data;
+static bool is_lazy(int threshold, redisReply *reply) {
+  return threshold > 0
+      && (reply->type == REDIS_REPLY_ARRAY || reply->type == REDIS_REPLY_SET)
+      && reply->elements >= (size_t)threshold;
+}
 
-  if (cc->flags & REDIS_DISCONNECTING) {
-    return;
+
+/* Detach the elements of a reply, the reader only frees the empty shell.
+ * The shell keeps its root for the other callbacks of a shared reply */
+static lazy_root_t* detach_reply(redisReply *reply) {
+
+  lazy_root_t* root;
+  if (reply->elements > 0 && reply->element == NULL) {
+    root = (lazy_root_t*)reply->str;
+    root->refs++;
+    return root;
   }
 
-  node_t* leaf = NULL;
+  root = (lazy_root_t*)malloc(sizeof(lazy_root_t));
+  redisReply* elements = (redisReply*)malloc(sizeof(redisReply));
+  if (root == NULL || elements == NULL) {
+    free(root);
+    free(elements);
+    return NULL;
+  }
+  *elements = *reply;
+  root->reply = elements;
+  root->refs = 1;
+  reply->element = NULL;
+  reply->str = (char*)root;
+  return root;
+}
 
-  search_timer(handle->repeat, cc->timers, &leaf);
 
-  callback_ll_t *temp = leaf->cb_list->head;
-  while(temp != NULL) {
+static void release_root(lazy_root_t* root) {
 
-    lua_State *L = cc->L;
-    lua_rawgeti(L, LUA_REGISTRYINDEX, temp->cb->ref);
+  if (root != NULL && --root->refs == 0) {
+    freeReplyObject(root->reply);
+    free(root);
+  }
+}
 
-    if (!(temp->cb->flags & CALLBACK_INITIALIZED)) {
-      lua_pushstring(L, "event received but not initialized");
-      lua_pcall(L, 1, 0, 0);
-    } else {
-      lua_pushnil(L);
-      lua_createtable(L, 3, 0);
-      lua_pushstring(L, "timer");
-      lua_rawseti(L, -2, 1);
-      lua_pushinteger(L, handle->repeat);
-      lua_rawseti(L, -2, 2);
-      lua_pushinteger(L, handle->timeout);
-      lua_rawseti(L, -2, 3);
-      lua_pcall(L, 2, 0, 0);
+
+/* Push a lazy reply, it holds a ref of the root */
+static void push_lazy_reply(lua_State *L, lazy_root_t* root,
+                            redisReply *reply, int threshold) {
+
+  lazy_reply_t* lazy = (lazy_reply_t*)lua_newuserdata(L, sizeof(lazy_reply_t));
+  lazy->root = root;
+  lazy->reply = reply;
+  lazy->threshold = threshold;
+  luaL_getmetatable(L, LUA_REPLY_MT);
+  lua_setmetatable(L, -2);
+}
+
+
+/* Push the reply of a command, large arrays as lazy replies */
+static int push_command_reply(client_context_t* cc, lua_State *L,
+                              redisReply *reply) {
+
+  if (is_lazy(cc->lazy_replies, reply)) {
+    lazy_root_t* root = detach_reply(reply);
+    if (root != NULL) {
+      push_lazy_reply(L, root, root->reply, cc->lazy_replies);
+      return 1;
     }
-    temp = temp->next;
   }
+  return push_reply(L, reply);
 }
 
 
-static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
-
-  client_context_t* cc = (client_context_t*)stream->data;
-  bool sub_mode = (cc->sub_stream == stream);
+/* Push an element of a lazy reply, from 1, nil if out of range */
+static void push_lazy_element(lua_State *L, lazy_reply_t* lazy, lua_Integer i) {
 
-  if (cc->flags & REDIS_DISCONNECTING) {
-    buf_free(buf);
+  if (i < 1 || (size_t)i > lazy->reply->elements) {
+    lua_pushnil(L);
     return;
   }
 
-  /* Error or connection closed by server */
-  if (nread < 0) {
-    /* Call Error Callback */
-    if (cc->r_error_cb != LUA_NOREF && cc->r_error_cb != LUA_REFNIL) {
-      const char* error = uv_strerror(nread);
-      lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_error_cb);
-      lua_pushstring(cc->L, error);
-      lua_pcall(cc->L, 1, 0, 0);
-    }
-    /* Disconnect */
-    uv_close((uv_handle_t*)stream, on_disconnect);
-    return;
+  redisReply* element = lazy->reply->element[i - 1];
+  if (is_lazy(lazy->threshold, element)) {
+    lazy->root->refs++;
+    push_lazy_reply(L, lazy->root, element, lazy->threshold);
+  } else {
+    push_reply(L, element);
   }
+}
 
-  if (nread > 0) {
-    if (redisReaderFeed(cc->reader,buf->base,nread) != REDIS_OK) {
-      /* Call Error Callback */
-      if (cc->r_error_cb != LUA_NOREF && cc->r_error_cb != LUA_REFNIL) {
-        lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_error_cb);
-        lua_pushstring(cc->L, cc->reader->errstr);
-        lua_pcall(cc->L, 1, 0, 0);
-      }
-      buf_free(buf);
-      return;
-    }
 
-    buf_free(buf);
+static int lua_reply_len(lua_State *L) {
 
-    callback_t cb;
-    void *reply = NULL;
-    int status;
-    while ((status = redisReaderGetReply(cc->reader,&reply)) == REDIS_OK) {
-      if (reply == NULL) {
-        /* When the connection is being disconnected and there are
-         * no more replies, this is the cue to really disconnect. */
-        if (cc->flags & REDIS_DISCONNECTING) {
-          //__redisAsyncDisconnect(ac);
-          return;
-        }
+  lazy_reply_t* lazy = (lazy_reply_t*)luaL_checkudata(L, 1, LUA_REPLY_MT);
+  lua_pushinteger(L, lazy->reply->elements);
+  return 1;
+}
 
-        /* If monitor mode, repush callback */
-        if (cc->flags & REDIS_MONITORING) {
-          callback_ll_t* wrapper = NULL;
-          if ( wrap_cb(&wrapper, &cb) == 0 ) {
-            push_cb(&cc->command_cb_list, wrapper);
-          }
-        }
 
-        /* When the connection is not being disconnected, simply stop
-         * trying to get replies and wait for the next loop tick. */
-        break;
-      }
+static int lua_reply_index(lua_State *L) {
 
-      if (sub_mode) {
-	      if (((redisReply*)reply)->type == REDIS_REPLY_ERROR) {
-		      // disconnect??
-		    } else {
-		      get_and_call_sub_cb(cc, reply);
-	      }
-        cc->reader->fn->freeObject(reply);
-      } else {
-	      if (shift_cb(&cc->command_cb_list, &cb) != 0) {
-		      if (((redisReply*)reply)->type == REDIS_REPLY_ERROR) {
-		        // disconnect??
-		      }
-	      }
+  lazy_reply_t* lazy = (lazy_reply_t*)luaL_checkudata(L, 1, LUA_REPLY_MT);
 
-	      if (cb.ref != LUA_NOREF && cb.ref != LUA_REFNIL) {
-	        lua_State *L = cc->L;
-          lua_rawgeti(L, LUA_REGISTRYINDEX, cb.ref);
-          luaL_unref(L, LUA_REGISTRYINDEX, cb.ref);
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    push_lazy_element(L, lazy, lua_tointeger(L, 2));
+    return 1;
+  }
 
-          lua_pushnil(L);
-          int argc = push_reply(L, reply);
-          lua_pcall(L, argc + 1, 0, 0);
+  /* Methods */
+  luaL_getmetatable(L, LUA_REPLY_MT);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  return 1;
+}
 
-          cc->reader->fn->freeObject(reply);
-		    } else {
-          /* No callback for this reply. This can either be a NULL callback,
-           * or there were no callbacks to begin with. Either way, don't
-           * abort with an error, but simply ignore it because the client
-           * doesn't know what the server will spit out over the wire. */
-           cc->reader->fn->freeObject(reply);
-        }
-	    }
-    }
 
-    if (reply != NULL) {
-      cc->reader->fn->freeObject(reply);
-    }
-    if (status == REDIS_ERR) {
-      //TODO disconnect?
-      return;
-    }
-  }
+static int lua_reply_next(lua_State *L) {
+
+  lazy_reply_t* lazy = (lazy_reply_t*)luaL_checkudata(L, 1, LUA_REPLY_MT);
+  lua_Integer i = luaL_checkinteger(L, 2) + 1;
 
-  /* Not subscribed context or No more callback */
-  if (!sub_mode
-      && cc->command_cb_list->head == NULL) {
-    uv_read_stop(stream);
+  if ((size_t)i > lazy->reply->elements) {
+    return 0;
   }
+  lua_pushinteger(L, i);
+  push_lazy_element(L, lazy, i);
+  return 2;
 }
 
 
-static void on_write(uv_write_t* handle, int status) {
+static int lua_reply_ipairs(lua_State *L) {
 
-  client_context_t* cc = (client_context_t*)handle->data;
-  uv_stream_t* stream = handle->handle;
-  stream->data = cc;
+  luaL_checkudata(L, 1, LUA_REPLY_MT);
+  lua_pushcfunction(L, lua_reply_next);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
 
-  req_free((uv_req_t*)handle);
 
-  if (status < 0) {
-    /* Call Callback */
-    callback_t cb;
-    if (shift_cb(&cc->command_cb_list, &cb) == 0) {
-      if (cb.ref != LUA_NOREF && cb.ref != LUA_REFNIL) {
-        const char* error = uv_strerror(status);
-        lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cb.ref);
-        luaL_unref(cc->L, LUA_REGISTRYINDEX, cb.ref);
-        lua_pushstring(cc->L, error);
-        lua_pcall(cc->L, 1, 0, 0);
-      }
-    }
+static int lua_reply_totable(lua_State *L) {
+
+  lazy_reply_t* lazy = (lazy_reply_t*)luaL_checkudata(L, 1, LUA_REPLY_MT);
+  return push_reply(L, lazy->reply);
+}
+
+
+static int lua_reply_gc(lua_State *L) {
+
+  lazy_reply_t* lazy = (lazy_reply_t*)luaL_checkudata(L, 1, LUA_REPLY_MT);
+  release_root(lazy->root);
+  lazy->root = NULL;
+  return 0;
+}
+
+/* Is the last argument a callback (function, coroutine or join slot)? */
+static bool has_callback(lua_State *L) {
+
+  if (lua_isfunction(L, -1) || lua_isthread(L, -1)) {
+    return true;
+  }
+  if (lua_type(L, -1) != LUA_TUSERDATA || !lua_getmetatable(L, -1)) {
+    return false;
+  }
+  luaL_getmetatable(L, LUA_JOIN_MT);
+  bool slot = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return slot;
+}
+
+
+/* Resume a coroutine with (err) or (nil, reply) */
+static void resume_thread(client_context_t* cc, lua_State *co,
+                          redisReply *reply, const char* error, const char* name) {
+
+  /* Failed before it yielded, snail:call returns the error */
+  if (co == cc->calling) {
+    cc->call_error = error;
+    return;
+  }
+  if (lua_status(co) != LUA_YIELD) {
     return;
   }
-  assert(status == 0);
 
-  /* Start Reading */
-  int r = uv_read_start(stream, buf_alloc, on_read);
-  if (r < 0) {
-    /* Call Callback */
-    const char* error = uv_strerror(r);
-    // TODO not the right cb in substream, false in sub stream
-    callback_t cb;
-    if ( shift_cb(&cc->command_cb_list, &cb) == 0 ) {
+  int argc = 1;
+  if (error != NULL) {
+    lua_pushstring(co, error);
+  } else {
+    lua_pushnil(co);
+    argc += push_command_reply(cc, co, reply);
+  }
+  int status = timed_resume(cc, co, argc, name);
+  if (status != 0 && status != LUA_YIELD) {
+    emit_error(cc, lua_tostring(co, -1));
+  }
+}
 
-      if (cb.ref != LUA_NOREF && cb.ref != LUA_REFNIL) {
-        lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cb.ref);
-        luaL_unref(cc->L, LUA_REGISTRYINDEX, cb.ref);
 
-        lua_pushstring(cc->L, error);
-        lua_pcall(cc->L, 1, 0, 0);
-      }
-    }
+/* Push (replies, errors or nil) of a join and free it */
+static void push_join(lua_State *L, join_t* join) {
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, join->replies_ref);
+  if (join->nb_errors > 0) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, join->errors_ref);
+  } else {
+    lua_pushnil(L);
   }
+  luaL_unref(L, LUA_REGISTRYINDEX, join->replies_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, join->errors_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, join->thread_ref);
+  free(join);
+}
 
-  return;
+
+/* One reply of a join, the coroutine is resumed by the last one */
+static void complete_join(client_context_t* cc, join_slot_t* slot,
+                          redisReply *reply, const char* error, const char* name) {
+
+  lua_State *L = cc->L;
+  join_t* join = slot->join;
+
+  if (error != NULL) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, join->errors_ref);
+    lua_pushstring(L, error);
+    join->nb_errors++;
+  } else {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, join->replies_ref);
+    push_command_reply(cc, L, reply);
+  }
+  lua_rawseti(L, -2, slot->index);
+  lua_pop(L, 1);
+
+  if (--join->remaining > 0 || !join->waiting) {
+    return;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, join->thread_ref);
+  lua_State *co = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  push_join(co, join);
+  int status = timed_resume(cc, co, 2, name);
+  if (status != 0 && status != LUA_YIELD) {
+    emit_error(cc, lua_tostring(co, -1));
+  }
 }
 
 
-static void on_connect(uv_connect_t* handle, int status) {
+/* Call the LUA callback of a command with either a reply or an error */
+static void call_callback(client_context_t* cc, callback_t* cb,
+                          redisReply *reply, const char* error) {
 
-  client_context_t* cc = (client_context_t*)handle->data;
-  req_free((uv_req_t*)handle);
+  /* Single-flight, identical commands are sent again from now on */
+  if (cb->key != NULL) {
+    delete_node(&cc->in_flight, cb->key);
+    free(cb->key);
+    cb->key = NULL;
+  }
 
-  if (status < 0) {
-    /* Call Error Callback */
-    if (cc->r_error_cb != LUA_NOREF && cc->r_error_cb != LUA_REFNIL) {
-      const char* error = uv_strerror(status);
-      lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_error_cb);
-      lua_pushstring(cc->L, error);
-      lua_pcall(cc->L, 1, 0, 0);
-      return;
+  /* Batch or single-flight, complete the children */
+  if (cb->children != NULL) {
+    size_t i = 0;
+    callback_ll_t *temp = cb->children->head;
+    while (temp != NULL) {
+      if (error == NULL && (cb->flags & CALLBACK_BATCH)
+          && reply->type == REDIS_REPLY_ARRAY && i < reply->elements) {
+        complete_callback(cc, temp->cb, reply->element[i], NULL);
+      } else {
+        complete_callback(cc, temp->cb, reply, error);
+      }
+      temp = temp->next;
+      i++;
     }
+  }
 
-    /* Disconnect */
-    uv_close((uv_handle_t*)cc->stream, on_disconnect);
+  /* C handler, called once */
+  if (cb->fn != NULL) {
+    reply_fn fn = cb->fn;
+    cb->fn = NULL;
+    fn(cc, cb, reply, error);
     return;
   }
-  assert(status == 0);
 
-  if (!(cc->stream_flags & STREAM_CONNECTED)) {
-    cc->stream_flags |= STREAM_CONNECTED;
-  } else if ((cc->stream_flags & STREAM_CONNECTED)
-      && !(cc->stream_flags & SUB_STREAM_CONNECTED)) {
-    cc->stream_flags |= SUB_STREAM_CONNECTED;
+  if (cb->ref == LUA_NOREF || cb->ref == LUA_REFNIL) {
+    return;
   }
 
-  if ((cc->stream_flags & STREAM_CONNECTED)
-      && (cc->stream_flags & SUB_STREAM_CONNECTED)) {
-    cc->flags |= REDIS_CONNECTED;
+  lua_State *L = cc->L;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cb->ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, cb->ref);
+  cb->ref = LUA_REFNIL;
+  const char* name = cb->hist != NULL ? cb->hist->name : "command";
+
+  /* snail:call and snail:call_all */
+  if (lua_isthread(L, -1)) {
+    lua_State *co = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    resume_thread(cc, co, reply, error, name);
+    return;
+  } else if (lua_type(L, -1) == LUA_TUSERDATA) {
+    join_slot_t* slot = (join_slot_t*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    complete_join(cc, slot, reply, error, name);
+    return;
+  }
 
-    /* Call Connect Callback */
-    if (cc->r_connect_cb != LUA_NOREF && cc->r_connect_cb != LUA_REFNIL) {
-      lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_connect_cb);
-      lua_pcall(cc->L, 0, 0, 0);
-    }
+  if (error != NULL) {
+    lua_pushstring(L, error);
+    timed_pcall(cc, 1, NULL, name);
+  } else {
+    lua_pushnil(L);
+    int argc = push_command_reply(cc, L, reply);
+    timed_pcall(cc, argc + 1, NULL, name);
   }
-  return;
 }
 
 
-static int lua_client_command(lua_State *L) {
-#ifdef LUA_STACK_CHECK
-  //stackDump(L);
-  int top = lua_gettop(L);
-#endif
-  static const char *argv[LUA_MAX_STACK];
-  static size_t argvlen[LUA_MAX_STACK];
-  static const char *timers[100];
+static void complete_callback(client_context_t* cc, callback_t* cb,
+                              redisReply *reply, const char* error) {
 
-  client_context_t *cc = (client_context_t*)
-                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+  /* Single-flight, the shared reply is detached once for its lazy replies */
+  lazy_root_t* root = NULL;
+  if (cb->children != NULL && !(cb->flags & CALLBACK_BATCH)
+      && error == NULL && is_lazy(cc->lazy_replies, reply)) {
+    root = detach_reply(reply);
+  }
 
-  int argc, i, nb_timers;
-  argc = 0;
-  nb_timers = 0;
-  /* Is there callback? */
-  int ltop = lua_isfunction(L, -1) ? lua_gettop(L) -1 : lua_gettop(L);
+  call_callback(cc, cb, reply, error);
+  release_root(root);
+}
+
+
+/* Take the next callback off the command list,
+ * it must be released after use */
+static callback_t* shift_command_cb(client_context_t* cc) {
+
+  callback_ll_t* head = cc->command_cb_list->head;
+  if (head == NULL) {
+    return NULL;
+  }
+
+  callback_t* cb = head->cb;
+  /* Keep it alive after the shift */
+  cb->attach++;
+  /* Detach it from the timeout wheel */
+  cb->flags |= CALLBACK_DONE;
+  shift_cb(&cc->command_cb_list, NULL);
+  cc->nb_pending--;
+
+  return cb;
+}
+
+
+/* Call every pending command callback with an error */
+static void fail_command_cbs(client_context_t* cc, const char* error) {
+
+  callback_t* cb;
+  while ((cb = shift_command_cb(cc)) != NULL) {
+    complete_callback(cc, cb, NULL, error);
+    release_callback(cb);
+  }
+}
+
+
+static void on_command_timeout(callback_t* cb, void* data) {
+
+  client_context_t* cc = (client_context_t*)data;
+
+  /* The callback stays in the command list to keep the reply order,
+   * the late reply will be discarded */
+  cb->flags |= CALLBACK_TIMED_OUT;
+  cc->stats.timeouts++;
+  complete_callback(cc, cb, NULL, "command: Timeout");
+}
+
+
+static void on_wheel_timer(uv_timer_t* handle) {
+
+  client_context_t* cc = (client_context_t*)handle->data;
+
+  wheel_sweep(cc->wheel, uv_now(handle->loop), on_command_timeout, cc);
+
+  if (cc->wheel->count == 0) {
+    uv_timer_stop(handle);
+  }
+}
+
+
+/* Put a command callback in the timeout wheel */
+static int watch_timeout(client_context_t* cc, callback_t* cb, uint64_t timeout) {
+
+  uv_loop_t* loop = cc->stream->loop;
+  uint64_t now = uv_now(loop);
+
+  if (cc->wheel == NULL) {
+    if (create_wheel(&cc->wheel, WHEEL_RESOLUTION, now) != 0) {
+      return SNAIL_ERR;
+    }
+  }
+  if (cc->wheel_timer == NULL) {
+    cc->wheel_timer = (uv_timer_t*)malloc(sizeof(uv_timer_t));
+    if (cc->wheel_timer == NULL) {
+      return SNAIL_ERR;
+    }
+    uv_timer_init(loop, cc->wheel_timer);
+    cc->wheel_timer->data = cc;
+  }
+
+  cb->deadline = now + timeout;
+  if (wheel_add(cc->wheel, cb) != 0) {
+    return SNAIL_ERR;
+  }
+
+  if (!uv_is_active((uv_handle_t*)cc->wheel_timer)) {
+    uv_timer_start(cc->wheel_timer, on_wheel_timer,
+                   WHEEL_RESOLUTION, WHEEL_RESOLUTION);
+  }
+
+  return SNAIL_OK;
+}
+
+
+/* Is the stream over the high-water mark? */
+static bool above_high_water(client_context_t* cc, uv_stream_t* stream) {
+
+  bool above = (cc->high_water_bytes > 0
+                && stream->write_queue_size > cc->high_water_bytes)
+            || (cc->high_water_cmds > 0
+                && cc->nb_pending > cc->high_water_cmds);
+
+  if (above) {
+    cc->stream_flags |= CONTEXT_NEED_DRAIN;
+  }
+  return above;
+}
+
+
+/* Send the drain event once under the low-water mark */
+static void check_drain(client_context_t* cc) {
+
+  if (!(cc->stream_flags & CONTEXT_NEED_DRAIN)) {
+    return;
+  }
+
+  if (cc->stream->write_queue_size > cc->low_water_bytes
+      || cc->sub_stream->write_queue_size > cc->low_water_bytes
+      || cc->nb_pending > cc->low_water_cmds) {
+    return;
+  }
+  cc->stream_flags &= ~CONTEXT_NEED_DRAIN;
+
+  /* Call Drain Callback */
+  if (cc->r_drain_cb != LUA_NOREF && cc->r_drain_cb != LUA_REFNIL) {
+    lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_drain_cb);
+    lua_pcall(cc->L, 0, 0, 0);
+  }
+}
+
+
+static bool is_read_only(const char* name, size_t len) {
+
+  int i;
+  for (i = 0; i <= NB_READ_ONLY - 1; i++) {
+    if (strlen(read_only[i]) == len && strncasecmp(read_only[i], name, len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/* Pub/sub and monitor commands change the reply flow */
+static bool changes_reply_flow(const char* name, size_t len) {
+  return (len >= 9 && strncasecmp(name + len - 9, "subscribe", 9) == 0)
+      || (len == 7 && strncasecmp(name, "monitor", 7) == 0);
+}
+
+
+static bool is_writable(client_context_t* cc) {
+  return (cc->flags & REDIS_CONNECTED)
+      && !(cc->flags & (REDIS_DISCONNECTING | REDIS_FREEING));
+}
+
+
+/* Record bytes read or written, the capture stops on error */
+static void capture_bytes(client_context_t* cc, uv_stream_t* stream, int dir,
+                          const char* buf, size_t len) {
+
+  int stream_id = stream == cc->stream ? CAPTURE_STREAM : CAPTURE_SUB_STREAM;
+  int r = capture_write(cc->capture, dir, stream_id, buf, len);
+  if (r < 0) {
+    capture_close(&cc->capture);
+    emit_error(cc, uv_strerror(r));
+  }
+}
+
+
+/* Write a formatted command, the request owns cmd until the write is done */
+static int write_command(uv_stream_t* stream, char* cmd, int len) {
+
+  client_context_t* cc = (client_context_t*)stream->data;
+  cc->stats.bytes_out += len;
+  SNAIL_PROBE3(write, cc, stream, len);
+  if (cc->capture != NULL) {
+    capture_bytes(cc, stream, CAPTURE_WRITE, cmd, len);
+  }
+
+  uv_buf_t buf = uv_buf_init(cmd, len);
+  uv_write_t* req = (uv_write_t*)req_alloc();
+  req->data = cmd;
+
+  int r = uv_write(req, stream, &buf, 1, on_write);
+  if (r < 0) {
+    req_free((uv_req_t*)req);
+    free(cmd);
+  }
+  return r;
+}
+
+
+static void flush_batches(client_context_t* cc);
+
+
+/* Forget the single-flight leaders of the tree, their replies complete them */
+static void forget_leaders(node_t* node) {
+
+  if (node == NULL) {
+    return;
+  }
+  forget_leaders(node->left);
+  forget_leaders(node->right);
+
+  callback_ll_t* temp = node->cb_list->head;
+  while (temp != NULL) {
+    free(temp->cb->key);
+    temp->cb->key = NULL;
+    temp = temp->next;
+  }
+}
+
+
+/* A write may change what the reads in flight return,
+ * the next reads must not join them */
+static void end_single_flight(client_context_t* cc) {
+
+  if (cc->in_flight != NULL) {
+    forget_leaders(cc->in_flight);
+    destroy_tree(&cc->in_flight);
+  }
+}
+
+
+/* Send a formatted internal command, cb (if any) waits in the command list.
+ * cmd is freed, so is cb on error */
+static int send_formatted(client_context_t* cc, uv_stream_t* stream,
+                          char* cmd, int len, callback_t* cb) {
+
+  if (stream == cc->stream) {
+    /* Keep the order with the batched reads */
+    if (cc->auto_batch) {
+      flush_batches(cc);
+    }
+    end_single_flight(cc);
+  }
+
+  callback_ll_t* wrapper = NULL;
+  if (cb != NULL && wrap_cb(&wrapper, cb) != 0) {
+    free(cmd);
+    destroy_callback(cb);
+    return UV_ENOMEM;
+  }
+
+  int r = write_command(stream, cmd, len);
+  if (r < 0) {
+    if (cb != NULL) {
+      free(wrapper);
+      destroy_callback(cb);
+    }
+    return r;
+  }
+
+  if (cb != NULL) {
+    /* RESP2 pub/sub stream has its own list */
+    if (stream == cc->sub_stream && !cc->resp3) {
+      push_cb(&cc->sub_cb_list, wrapper);
+    } else {
+      push_cb(&cc->command_cb_list, wrapper);
+      cc->nb_pending++;
+    }
+  }
+  return 0;
+}
+
+
+/* Send an internal command, see send_formatted */
+static int send_command(client_context_t* cc, uv_stream_t* stream, int argc,
+                        const char** argv, const size_t* argvlen, callback_t* cb) {
+
+  char *cmd;
+  int len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+  if (len < 0) {
+    if (cb != NULL) {
+      destroy_callback(cb);
+    }
+    return UV_ENOMEM;
+  }
+  return send_formatted(cc, stream, cmd, len, cb);
+}
+
+
+/* Call the error callback */
+static void emit_error(client_context_t* cc, const char* error) {
+
+  if (cc->r_error_cb != LUA_NOREF && cc->r_error_cb != LUA_REFNIL) {
+    lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_error_cb);
+    lua_pushstring(cc->L, error);
+    lua_pcall(cc->L, 1, 0, 0);
+  }
+}
+
+
+/* Call the connect callback */
+static void emit_connect(client_context_t* cc) {
+
+  if (cc->r_connect_cb != LUA_NOREF && cc->r_connect_cb != LUA_REFNIL) {
+    lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_connect_cb);
+    lua_pcall(cc->L, 0, 0, 0);
+  }
+}
+
+
+static void on_hello(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  redisReply* r = (redisReply*)reply;
+
+  if (error != NULL) {
+    emit_error(cc, error);
+  } else if (r->type == REDIS_REPLY_ERROR) {
+    emit_error(cc, r->str);
+  }
+}
+
+
+/* Tracking is on, the client can connect */
+static void on_tracking(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  redisReply* r = (redisReply*)reply;
+
+  if (error != NULL) {
+    emit_error(cc, error);
+    return;
+  } else if (r->type == REDIS_REPLY_ERROR) {
+    emit_error(cc, r->str);
+  }
+  emit_connect(cc);
+}
+
+
+/* CLIENT TRACKING on [REDIRECT id] [BCAST PREFIX p ...] */
+static int send_tracking(client_context_t* cc, const char* redirect) {
+
+  int argc = 0;
+  const char **argv = malloc((6 + 2 * cc->nb_tracking_prefixes) * sizeof(char*));
+  if (argv == NULL) {
+    return UV_ENOMEM;
+  }
+  argv[argc++] = "CLIENT";
+  argv[argc++] = "TRACKING";
+  argv[argc++] = "on";
+  if (redirect != NULL) {
+    argv[argc++] = "REDIRECT";
+    argv[argc++] = redirect;
+  }
+  if (cc->nb_tracking_prefixes > 0) {
+    int i;
+    argv[argc++] = "BCAST";
+    for (i = 0; i < cc->nb_tracking_prefixes; i++) {
+      argv[argc++] = "PREFIX";
+      argv[argc++] = cc->tracking_prefixes[i];
+    }
+  }
+
+  int r = UV_ENOMEM;
+  callback_t* cb = NULL;
+  if (create_callback(&cb, LUA_NOREF, 0) == 0) {
+    cb->fn = on_tracking;
+    r = send_command(cc, cc->stream, argc, argv, NULL, cb);
+  }
+  free(argv);
+  return r;
+}
+
+
+/* Id of the pub/sub connection, invalidations are redirected to it */
+static void on_client_id(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  redisReply* r = (redisReply*)reply;
+
+  if (error != NULL) {
+    emit_error(cc, error);
+    return;
+  } else if (r->type != REDIS_REPLY_INTEGER) {
+    emit_error(cc, r->type == REDIS_REPLY_ERROR ? r->str : "tracking: No client id");
+    emit_connect(cc);
+    return;
+  }
+
+  static const char *subscribe[] = {"SUBSCRIBE", INVALIDATE_CHANNEL};
+  char id[32];
+  snprintf(id, sizeof(id), "%lld", r->integer);
+
+  int e = send_command(cc, cc->sub_stream, 2, subscribe, NULL, NULL);
+  if (e == 0) {
+    e = send_tracking(cc, id);
+  }
+  if (e < 0) {
+    emit_error(cc, uv_strerror(e));
+    emit_connect(cc);
+  }
+}
+
+
+/* Enable the tracking, the connect callback is called once it is on */
+static int start_tracking(client_context_t* cc) {
+
+  if (cc->resp3) {
+    return send_tracking(cc, NULL);
+  }
+
+  static const char *client_id[] = {"CLIENT", "ID"};
+  callback_t* cb = NULL;
+  if (create_callback(&cb, LUA_NOREF, 0) != 0) {
+    return UV_ENOMEM;
+  }
+  cb->fn = on_client_id;
+  return send_command(cc, cc->sub_stream, 2, client_id, NULL, cb);
+}
+
+
+/* Call the invalidation callbacks of a key, or all of them when NULL */
+static void call_invalidation(client_context_t* cc, callback_ends_t* cb_list,
+                              const char* key, size_t len) {
+
+  callback_ll_t *temp = cb_list != NULL ? cb_list->head : NULL;
+  while (temp != NULL) {
+    lua_State *L = cc->L;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, temp->cb->ref);
+    lua_pushnil(L);
+    if (key != NULL) {
+      lua_pushlstring(L, key, len);
+    } else {
+      lua_pushnil(L);
+    }
+    timed_pcall(cc, 2, NULL, "invalidate");
+    temp = temp->next;
+  }
+}
+
+
+static void on_invalidate_all(node_t* node, void* data) {
+  call_invalidation((client_context_t*)data, node->cb_list, NULL, 0);
+}
+
+
+/* Keys array, or nil when the server flushed */
+static void dispatch_invalidation(client_context_t* cc, redisReply* keys) {
+
+  if (keys->type != REDIS_REPLY_ARRAY && keys->type != REDIS_REPLY_SET) {
+    walk_tree(cc->invalidations, on_invalidate_all, cc);
+    return;
+  }
+
+  unsigned int i;
+  for (i = 0; i < keys->elements; i++) {
+    redisReply* key = keys->element[i];
+    if (key->type != REDIS_REPLY_STRING) {
+      continue;
+    }
+    callback_ends_t* cb_list = NULL;
+    sds skey = sdsnewlen(key->str, key->len);
+    search(skey, cc->invalidations, &cb_list);
+    call_invalidation(cc, cb_list, key->str, key->len);
+    sdsfree(skey);
+  }
+}
+
+
+/* Notification class of a key event */
+static char event_class(const char* name) {
+
+  if (strcmp(name, "expired") == 0) {
+    return 'x';
+  } else if (strcmp(name, "evicted") == 0) {
+    return 'e';
+  } else if (strcmp(name, "set") == 0 || strcmp(name, "setrange") == 0
+      || strcmp(name, "append") == 0 || strncmp(name, "incrby", 6) == 0) {
+    return '$';
+  } else if (strcmp(name, "sortstore") == 0) {
+    return 'l';
+  }
+
+  switch (name[0]) {
+    case 'x': return 't';
+    case 'h': return 'h';
+    case 'z': return 'z';
+    case 's': return 's';
+    case 'l': return 'l';
+    case 'r':
+      return (strcmp(name, "rpop") == 0 || strcmp(name, "rpush") == 0) ? 'l' : 'g';
+    default: return 'g';
+  }
+}
+
+
+/* Flags K, E and classes needed, one byte each */
+typedef struct notify_s {
+  bool space;
+  bool event;
+  char classes[sizeof(NOTIFY_CLASSES)];
+} notify_t;
+
+
+static void add_notify_class(notify_t* n, char c) {
+  char* slot = strchr(NOTIFY_CLASSES, c);
+  n->classes[slot - NOTIFY_CLASSES] = c;
+}
+
+
+static void add_notify_channel(notify_t* n, const char* name, bool pattern) {
+
+  const char* glob = pattern ? strpbrk(name, "*?[") : NULL;
+  const char* tail = strstr(name, "__:");
+
+  if (strncmp(name, KEY_SPACE_ANY, strlen(KEY_SPACE_ANY)) == 0) {
+    /* Any event of the key */
+    n->space = true;
+    memcpy(n->classes, NOTIFY_CLASSES, strlen(NOTIFY_CLASSES));
+  } else if (strncmp(name, KEY_EVENT_ANY, strlen(KEY_EVENT_ANY)) == 0) {
+    n->event = true;
+    /* One event, unless the event name is a pattern */
+    if (tail != NULL && (!pattern || strpbrk(tail + 3, "*?[") == NULL)) {
+      add_notify_class(n, event_class(tail + 3));
+    } else {
+      memcpy(n->classes, NOTIFY_CLASSES, strlen(NOTIFY_CLASSES));
+    }
+  } else if (glob != NULL && strncmp(name, "__key", glob - name) == 0) {
+    /* Pattern matching both */
+    n->space = true;
+    n->event = true;
+    memcpy(n->classes, NOTIFY_CLASSES, strlen(NOTIFY_CLASSES));
+  }
+}
+
+
+static void on_notify_channel(node_t* node, void* data) {
+  add_notify_channel((notify_t*)data, node->key, false);
+}
+
+
+static void on_notify_pattern(node_t* node, void* data) {
+  add_notify_channel((notify_t*)data, node->key, true);
+}
+
+
+static void on_config_set(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  redisReply* r = (redisReply*)reply;
+
+  if (error == NULL && r->type == REDIS_REPLY_ERROR) {
+    error = r->str;
+  }
+  if (error != NULL) {
+    /* Try again on the next subscription */
+    cc->notify_config[0] = '\0';
+    emit_error(cc, error);
+  }
+}
+
+
+/* Flags and classes needed by the subscriptions */
+static void needed_notify_config(client_context_t* cc, notify_t* n) {
+
+  memset(n, 0, sizeof(*n));
+  walk_tree(cc->channels, on_notify_channel, n);
+  walk_tree(cc->patterns, on_notify_pattern, n);
+}
+
+
+/* K, E, then A or the classes */
+static int format_notify_config(const notify_t* n, bool all, char* config) {
+
+  int i, len = 0;
+  if (n->space) {
+    config[len++] = 'K';
+  }
+  if (n->event) {
+    config[len++] = 'E';
+  }
+  if (all || memcmp(n->classes, NOTIFY_CLASSES, strlen(NOTIFY_CLASSES)) == 0) {
+    config[len++] = 'A';
+  } else {
+    for (i = 0; i < strlen(NOTIFY_CLASSES); i++) {
+      if (n->classes[i] != '\0') {
+        config[len++] = n->classes[i];
+      }
+    }
+  }
+  config[len] = '\0';
+  return len;
+}
+
+
+/* The setting is server-wide, the needed flags are added to the current
+ * ones so the other clients of the instance keep theirs */
+static void on_config_get(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  redisReply* r = (redisReply*)reply;
+
+  if (error == NULL && r->type == REDIS_REPLY_ERROR) {
+    error = r->str;
+  }
+  if (error == NULL && ((r->type != REDIS_REPLY_ARRAY && r->type != REDIS_REPLY_MAP)
+      || r->elements != 2 || r->element[1]->type != REDIS_REPLY_STRING)) {
+    error = "CONFIG GET notify-keyspace-events: Unexpected reply";
+  }
+  if (error != NULL) {
+    on_config_set(ctx, cb, reply, error);
+    return;
+  }
+
+  /* Current flags, the ones unknown here (m, n, d...) are kept as is */
+  notify_t current;
+  memset(&current, 0, sizeof(current));
+  bool all = false;
+  char other[8];
+  int i, nb_other = 0;
+  const char* c;
+  for (c = r->element[1]->str; *c != '\0'; c++) {
+    if (*c == 'K') {
+      current.space = true;
+    } else if (*c == 'E') {
+      current.event = true;
+    } else if (*c == 'A') {
+      all = true;
+    } else if (strchr(NOTIFY_CLASSES, *c) != NULL) {
+      add_notify_class(&current, *c);
+    } else if (nb_other < sizeof(other) && memchr(other, *c, nb_other) == NULL) {
+      other[nb_other++] = *c;
+    }
+  }
+
+  notify_t n;
+  needed_notify_config(cc, &n);
+  bool missing = (n.space && !current.space) || (n.event && !current.event);
+  current.space |= n.space;
+  current.event |= n.event;
+  for (i = 0; i < strlen(NOTIFY_CLASSES); i++) {
+    if (n.classes[i] != '\0' && current.classes[i] == '\0' && !all) {
+      missing = true;
+      current.classes[i] = n.classes[i];
+    }
+  }
+  if (!missing || !is_writable(cc)) {
+    return;
+  }
+
+  char config[sizeof(cc->notify_config) + sizeof(other) + 1];
+  int len = format_notify_config(&current, all, config);
+  memcpy(config + len, other, nb_other);
+  config[len + nb_other] = '\0';
+
+  const char *argv[] = {"CONFIG", "SET", "notify-keyspace-events", config};
+  callback_t* set_cb = NULL;
+  int e = create_callback(&set_cb, LUA_NOREF, 0);
+  if (e == 0) {
+    set_cb->fn = on_config_set;
+    e = send_command(cc, cc->stream, 4, argv, NULL, set_cb);
+  }
+  if (e < 0) {
+    cc->notify_config[0] = '\0';
+    emit_error(cc, uv_strerror(e));
+  }
+}
+
+
+/* Minimal notify-keyspace-events for the subscriptions, CONFIG GET then
+ * CONFIG SET of the missing flags, only when the needed ones change */
+static int update_notify_config(client_context_t* cc) {
+
+  notify_t n;
+  needed_notify_config(cc, &n);
+
+  /* Only plain channels or timers, the server-wide setting is left
+   * to the other clients */
+  if (!n.space && !n.event) {
+    return 0;
+  }
+
+  char config[sizeof(cc->notify_config)];
+  format_notify_config(&n, false, config);
+
+  if (cc->notify_config[0] != '\0' && strcmp(config, cc->notify_config + 1) == 0) {
+    return 0;
+  }
+
+  const char *argv[] = {"CONFIG", "GET", "notify-keyspace-events"};
+  callback_t* cb = NULL;
+  if (create_callback(&cb, LUA_NOREF, 0) != 0) {
+    return UV_ENOMEM;
+  }
+  cb->fn = on_config_get;
+  /* Requested, the first byte tells it is known */
+  cc->notify_config[0] = '+';
+  strcpy(cc->notify_config + 1, config);
+  return send_command(cc, cc->stream, 3, argv, NULL, cb);
+}
+
+
+/* Feed the subscription callbacks with a synthetic pub/sub reply */
+static void dispatch_sub_reply(client_context_t* cc, const char* type,
+                               const char* channel, size_t len, redisReply* payload) {
+
+  redisReply head, name;
+  redisReply *element[3] = {&head, &name, payload};
+  redisReply reply;
+
+  memset(&head, 0, sizeof(head));
+  head.type = REDIS_REPLY_STRING;
+  head.str = (char*)type;
+  head.len = strlen(type);
+  memset(&name, 0, sizeof(name));
+  name.type = REDIS_REPLY_STRING;
+  name.str = (char*)channel;
+  name.len = len;
+  memset(&reply, 0, sizeof(reply));
+  reply.type = REDIS_REPLY_ARRAY;
+  reply.elements = 3;
+  reply.element = element;
+
+  get_and_call_sub_cb(cc, &reply);
+}
+
+
+static void durable_read(client_context_t* cc);
+
+
+static void on_durable_ack(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  redisReply* r = (redisReply*)reply;
+
+  if (error == NULL && r->type == REDIS_REPLY_ERROR) {
+    emit_error(cc, r->str);
+  }
+}
+
+
+/* XREADGROUP reply, entries are dispatched then acknowledged in one XACK */
+static void on_durable_read(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  durable_t* durable = cc->durable;
+  redisReply* r = (redisReply*)reply;
+
+  if (error != NULL) {
+    return;
+  } else if (r->type == REDIS_REPLY_ERROR) {
+    emit_error(cc, r->str);
+    return;
+  }
+
+  /* [[stream, [[id, [field, value, ...]], ...]]], nil on timeout */
+  redisReply* entries = NULL;
+  if (r->type == REDIS_REPLY_ARRAY && r->elements > 0
+      && r->element[0]->type == REDIS_REPLY_ARRAY
+      && r->element[0]->elements == 2
+      && r->element[0]->element[1]->type == REDIS_REPLY_ARRAY) {
+    entries = r->element[0]->element[1];
+  }
+  size_t nb_entries = entries != NULL ? entries->elements : 0;
+
+  const char **ack = malloc((nb_entries + 3) * sizeof(char*));
+  if (ack == NULL) {
+    emit_error(cc, "durable: Out Of Memory");
+    return;
+  }
+  int argc = 0;
+  ack[argc++] = "XACK";
+  ack[argc++] = durable->stream;
+  ack[argc++] = durable->group;
+
+  size_t i, j;
+  for (i = 0; i < nb_entries; i++) {
+    redisReply* entry = entries->element[i];
+    if (entry->type != REDIS_REPLY_ARRAY || entry->elements < 2
+        || entry->element[0]->type != REDIS_REPLY_STRING) {
+      continue;
+    }
+
+    /* Deleted pending entries have no fields */
+    redisReply* fields = entry->element[1];
+    redisReply* channel = NULL;
+    redisReply* message = NULL;
+    for (j = 0; fields->type == REDIS_REPLY_ARRAY && j + 1 < fields->elements; j += 2) {
+      redisReply* field = fields->element[j];
+      if (field->type != REDIS_REPLY_STRING) {
+        continue;
+      } else if (strcmp(field->str, "channel") == 0) {
+        channel = fields->element[j + 1];
+      } else if (strcmp(field->str, "message") == 0) {
+        message = fields->element[j + 1];
+      }
+    }
+    if (channel != NULL && message != NULL
+        && channel->type == REDIS_REPLY_STRING) {
+      dispatch_sub_reply(cc, "message", channel->str, channel->len, message);
+    }
+
+    ack[argc++] = entry->element[0]->str;
+    if (durable->recovering) {
+      sdsfree(durable->last_id);
+      durable->last_id = sdsnewlen(entry->element[0]->str, entry->element[0]->len);
+    }
+  }
+
+  /* At least once, acknowledged after the callbacks */
+  if (argc > 3 && is_writable(cc)) {
+    callback_t* ack_cb = NULL;
+    if (create_callback(&ack_cb, LUA_NOREF, 0) == 0) {
+      ack_cb->fn = on_durable_ack;
+      int e = send_command(cc, cc->stream, argc, ack, NULL, ack_cb);
+      if (e < 0) {
+        emit_error(cc, uv_strerror(e));
+      }
+    }
+  }
+  free(ack);
+
+  if (!is_writable(cc)) {
+    return;
+  }
+  if (durable->recovering && nb_entries == 0) {
+    /* No more pending entries, two new reads in flight */
+    durable->recovering = false;
+    durable_read(cc);
+    durable_read(cc);
+  } else {
+    durable_read(cc);
+  }
+}
+
+
+static void durable_read(client_context_t* cc) {
+
+  durable_t* durable = cc->durable;
+  const char *argv[12];
+  int argc = 0;
+
+  argv[argc++] = "XREADGROUP";
+  argv[argc++] = "GROUP";
+  argv[argc++] = durable->group;
+  argv[argc++] = durable->consumer;
+  argv[argc++] = "COUNT";
+  argv[argc++] = durable->count;
+  /* Pending entries are returned at once */
+  if (!durable->recovering) {
+    argv[argc++] = "BLOCK";
+    argv[argc++] = durable->block;
+  }
+  argv[argc++] = "STREAMS";
+  argv[argc++] = durable->stream;
+  argv[argc++] = durable->recovering ? durable->last_id : ">";
+
+  int r = UV_ENOMEM;
+  callback_t* cb = NULL;
+  if (create_callback(&cb, LUA_NOREF, 0) == 0) {
+    cb->fn = on_durable_read;
+    r = send_command(cc, cc->sub_stream, argc, argv, NULL, cb);
+  }
+  if (r < 0) {
+    emit_error(cc, uv_strerror(r));
+  }
+}
+
+
+/* The group exists, recover the pending entries first */
+static void on_group_create(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  redisReply* r = (redisReply*)reply;
+
+  if (error != NULL) {
+    return;
+  } else if (r->type == REDIS_REPLY_ERROR
+      && strncmp(r->str, "BUSYGROUP", 9) != 0) {
+    emit_error(cc, r->str);
+    return;
+  }
+
+  cc->durable->recovering = true;
+  sdsfree(cc->durable->last_id);
+  cc->durable->last_id = sdsnew("0");
+  durable_read(cc);
+}
+
+
+static int durable_start(client_context_t* cc) {
+
+  const char *argv[] = {"XGROUP", "CREATE", cc->durable->stream,
+                        cc->durable->group, "$", "MKSTREAM"};
+  callback_t* cb = NULL;
+  if (create_callback(&cb, LUA_NOREF, 0) != 0) {
+    return UV_ENOMEM;
+  }
+  cb->fn = on_group_create;
+  return send_command(cc, cc->stream, 6, argv, NULL, cb);
+}
+
+
+/* Canary notification, its time is the end of the key */
+static void on_canary_message(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  redisReply* r = (redisReply*)reply;
+
+  /* pmessage, pattern, channel, event */
+  if (r == NULL || r->elements < 4 || r->element[2]->type != REDIS_REPLY_STRING
+      || r->element[3]->type != REDIS_REPLY_STRING
+      || strcmp(r->element[3]->str, "set") != 0) {
+    return;
+  }
+  const char* time = strrchr(r->element[2]->str, ':');
+  if (time == NULL) {
+    return;
+  }
+  uint64_t sent = strtoull(time + 1, NULL, 10);
+  uint64_t now = uv_hrtime();
+  if (sent == 0 || sent > now) {
+    return;
+  }
+  hist_record(&cc->stats.canary, (now - sent) / 1000);
+  if (cc->read_time >= sent) {
+    hist_record(&cc->stats.canary_read, (cc->read_time - sent) / 1000);
+  }
+}
+
+
+/* Write the next canary key, it expires by itself */
+static void on_canary_timer(uv_timer_t* handle) {
+
+  client_context_t* cc = (client_context_t*)handle->data;
+  canary_t* canary = cc->canary;
+  if (!is_writable(cc)) {
+    return;
+  }
+
+  char key[96];
+  char px[24];
+  snprintf(key, sizeof(key), "%s%" PRIu64, canary->prefix, uv_hrtime());
+  snprintf(px, sizeof(px), "%" PRIu64, 2 * canary->interval + 1000);
+  const char *argv[] = {"SET", key, "1", "PX", px};
+
+  callback_t* cb = NULL;
+  if (create_callback(&cb, LUA_NOREF, 0) != 0) {
+    return;
+  }
+  int r = send_command(cc, cc->stream, 5, argv, NULL, cb);
+  if (r < 0) {
+    emit_error(cc, uv_strerror(r));
+    return;
+  }
+  cc->stats.canaries++;
+}
+
+
+/* Subscribe to the canary keys then write one every interval */
+static int canary_start(client_context_t* cc) {
+
+  canary_t* canary = cc->canary;
+  char pattern[96];
+  snprintf(pattern, sizeof(pattern), KEY_SPACE_ANY "*__:%s*", canary->prefix);
+
+  /* The pattern tree is destroyed on disconnect, its callback with it */
+  node_t *leaf = NULL;
+  search_node(pattern, cc->patterns, &leaf);
+  if (leaf == NULL || leaf->cb_list->head == NULL) {
+    callback_t* cb = NULL;
+    callback_ll_t* wrapper = NULL;
+    if (create_callback(&cb, LUA_NOREF, 0) != 0) {
+      return UV_ENOMEM;
+    }
+    if (insert(&cc->patterns, &leaf, pattern) != 0
+        || wrap_cb(&wrapper, cb) != 0) {
+      destroy_callback(cb);
+      return UV_ENOMEM;
+    }
+    cb->flags |= CALLBACK_INITIALIZED;
+    cb->fn = on_canary_message;
+    push_cb(&leaf->cb_list, wrapper);
+  }
+
+  const char *argv[] = {"PSUBSCRIBE", pattern};
+  int r = 0;
+  if (cc->auto_notify_config) {
+    r = update_notify_config(cc);
+  }
+  if (r == 0) {
+    r = send_command(cc, cc->sub_stream, 2, argv, NULL, NULL);
+  }
+  if (r < 0) {
+    return r;
+  }
+
+  if (canary->timer == NULL) {
+    /* Get the uv loop */
+    lua_pushstring(cc->L, "uv_loop");
+    lua_rawget(cc->L, LUA_REGISTRYINDEX);
+    uv_loop_t* loop = lua_touserdata(cc->L, -1);
+    lua_pop(cc->L, 1);
+
+    canary->timer = (uv_timer_t*)malloc(sizeof(uv_timer_t));
+    if (canary->timer == NULL) {
+      return UV_ENOMEM;
+    }
+    uv_timer_init(loop, canary->timer);
+    canary->timer->data = cc;
+    uv_timer_start(canary->timer, on_canary_timer, canary->interval,
+                   canary->interval);
+  }
+  return 0;
+}
+
+
+static void destroy_rules(rule_t** rules) {
+
+  while (*rules != NULL) {
+    rule_t* rule = *rules;
+    int i;
+    *rules = rule->next;
+    for (i = 0; i < rule->nb_keys + rule->nb_args; i++) {
+      sdsfree(rule->args[i].literal);
+    }
+    free(rule->args);
+    sdsfree(rule->sha);
+    sdsfree(rule->script);
+    free(rule);
+  }
+}
+
+
+/* Fill argv from the rule templates, returns argc */
+static int format_rule(rule_t* rule, const char** argv, size_t* argvlen, char* nb_keys,
+                       redisReply* channel, redisReply* message) {
+
+  int i, argc = 0;
+  argv[argc] = nb_keys;
+  argvlen[argc++] = strlen(nb_keys);
+
+  for (i = 0; i < rule->nb_keys + rule->nb_args; i++) {
+    rule_arg_t* arg = &rule->args[i];
+    switch (arg->kind) {
+      case RULE_CHANNEL:
+        argv[argc] = channel->str;
+        argvlen[argc++] = channel->len;
+        break;
+      case RULE_MESSAGE:
+        argv[argc] = message->str;
+        argvlen[argc++] = message->len;
+        break;
+      case RULE_KEY: {
+        /* Key of a key-space channel, message of a key-event one */
+        const char* tail = strstr(channel->str, "__:");
+        if (tail != NULL && strncmp(channel->str, KEY_SPACE_ANY, strlen(KEY_SPACE_ANY)) == 0) {
+          argv[argc] = tail + 3;
+          argvlen[argc++] = channel->len - (tail + 3 - channel->str);
+        } else {
+          argv[argc] = message->str;
+          argvlen[argc++] = message->len;
+        }
+        break;
+      }
+      default:
+        argv[argc] = arg->literal;
+        argvlen[argc++] = sdslen(arg->literal);
+    }
+  }
+  return argc;
+}
+
+
+static void on_rule_reply(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  redisReply* r = (redisReply*)reply;
+
+  if (error == NULL && r->type == REDIS_REPLY_ERROR) {
+    emit_error(cc, r->str);
+  }
+}
+
+
+/* Script not cached, run it with EVAL, it is cached for the next ones */
+static void on_rule_noscript(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  redisReply* r = (redisReply*)reply;
+  rule_call_t* call = (rule_call_t*)cb->data;
+  cb->data = NULL;
+
+  if (error == NULL && r->type == REDIS_REPLY_ERROR) {
+    if (strncmp(r->str, "NOSCRIPT", 8) == 0 && is_writable(cc)) {
+      sds script = call->rule->script;
+      sds head = sdscatprintf(sdsempty(), "*%d\r\n$4\r\nEVAL\r\n$%zu\r\n",
+                              call->argc + 2, sdslen(script));
+      size_t len = sdslen(head) + sdslen(script) + 2 + call->len;
+      callback_t* eval_cb = NULL;
+      /* Written buffers are freed with free() */
+      char* cmd = malloc(len);
+      if (cmd != NULL && create_callback(&eval_cb, LUA_NOREF, 0) == 0) {
+        eval_cb->fn = on_rule_reply;
+        char* p = cmd;
+        memcpy(p, head, sdslen(head));
+        p += sdslen(head);
+        memcpy(p, script, sdslen(script));
+        p += sdslen(script);
+        memcpy(p, "\r\n", 2);
+        memcpy(p + 2, call->tail, call->len);
+        int e = send_formatted(cc, cc->stream, cmd, len, eval_cb);
+        if (e < 0) {
+          emit_error(cc, uv_strerror(e));
+        }
+      } else {
+        free(cmd);
+      }
+      sdsfree(head);
+    } else {
+      emit_error(cc, r->str);
+    }
+  }
+  free(call);
+}
+
+
+/* Notification matching a rule */
+static void on_rule(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  rule_t* rule = (rule_t*)cb->data;
+  redisReply* r = (redisReply*)reply;
+
+  if (!is_writable(cc) || r->elements < 3) {
+    return;
+  }
+  /* [message, channel, payload] or [pmessage, pattern, channel, payload] */
+  bool pvariant = (tolower(r->element[0]->str[0]) == 'p');
+  if (pvariant && r->elements < 4) {
+    return;
+  }
+  redisReply* channel = r->element[pvariant ? 2 : 1];
+  redisReply* message = r->element[pvariant ? 3 : 2];
+  if (channel->type != REDIS_REPLY_STRING || message->type != REDIS_REPLY_STRING) {
+    return;
+  }
+
+  const char *argv[RULE_MAX_ARGS + 3];
+  size_t argvlen[RULE_MAX_ARGS + 3];
+  char nb_keys[16];
+  snprintf(nb_keys, sizeof(nb_keys), "%d", rule->nb_keys);
+  int argc = format_rule(rule, argv + 2, argvlen + 2, nb_keys, channel, message) + 2;
+
+  argv[0] = "EVALSHA";
+  argvlen[0] = 7;
+  argv[1] = rule->sha;
+  argvlen[1] = sdslen(rule->sha);
+
+  char* cmd;
+  int len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+  if (len < 0) {
+    emit_error(cc, uv_strerror(UV_ENOMEM));
+    return;
+  }
+
+  callback_t* rule_cb = NULL;
+  if (create_callback(&rule_cb, LUA_NOREF, 0) != 0) {
+    free(cmd);
+    return;
+  }
+  rule_cb->fn = on_rule_reply;
+
+  /* The arguments are kept for a NOSCRIPT reply, the EVAL is only built then.
+   * They follow "*<argc>\r\n$7\r\nEVALSHA\r\n$<len>\r\n<sha>\r\n" */
+  rule_call_t* call = NULL;
+  if (rule->script != NULL) {
+    size_t head = snprintf(NULL, 0, "*%d\r\n$7\r\nEVALSHA\r\n$%zu\r\n",
+                           argc, sdslen(rule->sha)) + sdslen(rule->sha) + 2;
+    call = (rule_call_t*)malloc(sizeof(rule_call_t) + len - head);
+    if (call != NULL) {
+      call->rule = rule;
+      call->argc = argc - 2;
+      call->len = len - head;
+      memcpy(call->tail, cmd + head, call->len);
+      rule_cb->fn = on_rule_noscript;
+      rule_cb->data = call;
+    }
+  }
+
+  int e = send_formatted(cc, cc->stream, cmd, len, rule_cb);
+  if (e < 0) {
+    free(call);
+    emit_error(cc, uv_strerror(e));
+  }
+}
+
+
+static void destroy_scripts(script_t** scripts) {
+
+  while (*scripts != NULL) {
+    script_t* script = *scripts;
+    *scripts = script->next;
+    sdsfree(script->name);
+    sdsfree(script->source);
+    sdsfree(script->sha);
+    free(script);
+  }
+}
+
+
+static script_t* find_script(client_context_t* cc, const char* name) {
+
+  script_t* script = cc->scripts;
+  while (script != NULL && strcmp(script->name, name) != 0) {
+    script = script->next;
+  }
+  return script;
+}
+
+
+/* SHA1 of the script, EVALSHA can be used */
+static void on_script_load(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  script_t* script = (script_t*)cb->data;
+  redisReply* r = (redisReply*)reply;
+
+  if (error != NULL) {
+    return;
+  } else if (r->type == REDIS_REPLY_STRING) {
+    sdsfree(script->sha);
+    script->sha = sdsnewlen(r->str, r->len);
+  } else if (r->type == REDIS_REPLY_ERROR) {
+    emit_error(cc, r->str);
+  }
+}
+
+
+static int load_script(client_context_t* cc, script_t* script) {
+
+  const char *argv[] = {"SCRIPT", "LOAD", script->source};
+  size_t argvlen[] = {6, 4, sdslen(script->source)};
+  callback_t* cb = NULL;
+  if (create_callback(&cb, LUA_NOREF, 0) != 0) {
+    return UV_ENOMEM;
+  }
+  cb->fn = on_script_load;
+  cb->data = script;
+  return send_command(cc, cc->stream, 3, argv, argvlen, cb);
+}
+
+
+/* Pipeline SCRIPT LOAD of every script */
+static void load_scripts(client_context_t* cc) {
+
+  script_t* script;
+  for (script = cc->scripts; script != NULL; script = script->next) {
+    int r = load_script(cc, script);
+    if (r < 0) {
+      emit_error(cc, uv_strerror(r));
+      return;
+    }
+  }
+}
+
+
+/* Script call, the formatted numkeys, keys and args are kept for NOSCRIPT */
+typedef struct script_call_s {
+  script_t* script;
+  sds tail;
+  int argc;
+} script_call_t;
+
+
+/* EVALSHA sha or EVAL source, followed by the tail */
+static int send_script_call(client_context_t* cc, script_call_t* call, bool sha,
+                            callback_t* cb) {
+
+  sds body = sha ? call->script->sha : call->script->source;
+  sds cmd = sdscatprintf(sdsempty(), "*%d\r\n$%d\r\n%s\r\n$%zu\r\n",
+                         call->argc + 2, sha ? 7 : 4, sha ? "EVALSHA" : "EVAL",
+                         sdslen(body));
+  cmd = sdscatlen(cmd, body, sdslen(body));
+  cmd = sdscatlen(cmd, "\r\n", 2);
+  cmd = sdscatlen(cmd, call->tail, sdslen(call->tail));
+
+  /* Written buffers are freed with free() */
+  char* buf = malloc(sdslen(cmd));
+  if (buf == NULL) {
+    sdsfree(cmd);
+    destroy_callback(cb);
+    return UV_ENOMEM;
+  }
+  memcpy(buf, cmd, sdslen(cmd));
+  int len = sdslen(cmd);
+  sdsfree(cmd);
+
+  int r = send_formatted(cc, cc->stream, buf, len, cb);
+  if (r == 0 && cc->timeout > 0) {
+    watch_timeout(cc, cb, cc->timeout);
+  }
+  return r;
+}
+
+
+static void destroy_script_call(script_call_t* call) {
+  sdsfree(call->tail);
+  free(call);
+}
+
+
+/* Reply of a script call, retried with EVAL on NOSCRIPT */
+static void on_script_call(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  script_call_t* call = (script_call_t*)cb->data;
+  redisReply* r = (redisReply*)reply;
+  cb->data = NULL;
+
+  if (error == NULL && r->type == REDIS_REPLY_ERROR
+      && strncmp(r->str, "NOSCRIPT", 8) == 0 && is_writable(cc)) {
+    /* The LUA callback moves to the EVAL */
+    callback_t* eval_cb = NULL;
+    int ref = cb->ref;
+    if (create_callback(&eval_cb, ref, 0) == 0) {
+      cb->ref = LUA_NOREF;
+      int e = send_script_call(cc, call, false, eval_cb);
+      destroy_script_call(call);
+      if (e == 0) {
+        return;
+      }
+      /* Back to this callback for the error */
+      cb->ref = ref;
+      complete_callback(cc, cb, NULL, uv_strerror(e));
+      return;
+    }
+  }
+
+  destroy_script_call(call);
+  complete_callback(cc, cb, reply, error);
+}
+
+
+static void on_scan(void* ctx, callback_t* cb, void* reply, const char* error);
+
+
+/* Free a scan once nothing refers to it */
+static void release_scan(scan_t* scan) {
+
+  if (!scan->done || scan->in_flight || scan->running > 0) {
+    return;
+  }
+  int i;
+  for (i = 0; i < scan->argc; i++) {
+    sdsfree(scan->argv[i]);
+  }
+  free(scan->argv);
+  free(scan);
+}
+
+
+/* Call the done callback (err, count) once */
+static void finish_scan(client_context_t* cc, scan_t* scan, const char* error) {
+
+  if (scan->done) {
+    return;
+  }
+  scan->done = true;
+
+  lua_State *L = cc->L;
+  luaL_unref(L, LUA_REGISTRYINDEX, scan->batch_ref);
+  if (scan->done_ref != LUA_NOREF && scan->done_ref != LUA_REFNIL) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, scan->done_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, scan->done_ref);
+    if (error != NULL) {
+      lua_pushstring(L, error);
+    } else {
+      lua_pushnil(L);
+    }
+    lua_pushinteger(L, scan->count);
+    lua_pcall(L, 2, 0, 0);
+  }
+}
+
+
+/* Send the step of a cursor */
+static int scan_step(client_context_t* cc, scan_t* scan,
+                     const char* cursor, size_t len) {
+
+  static const char *argv[8];
+  static size_t argvlen[8];
+
+  scan->argv[scan->cursor] = sdscpylen(scan->argv[scan->cursor], cursor, len);
+
+  int i;
+  for (i = 0; i < scan->argc; i++) {
+    argv[i] = scan->argv[i];
+    argvlen[i] = sdslen(scan->argv[i]);
+  }
+
+  callback_t* cb = NULL;
+  if (create_callback(&cb, LUA_NOREF, 0) != 0) {
+    return UV_ENOMEM;
+  }
+  cb->fn = on_scan;
+  cb->data = scan;
+
+  int r = send_command(cc, cc->stream, scan->argc, argv, argvlen, cb);
+  if (r < 0) {
+    return r;
+  }
+  scan->in_flight = true;
+
+  if (cc->timeout > 0 && watch_timeout(cc, cb, cc->timeout) != 0) {
+    return UV_ENOMEM;
+  }
+  return 0;
+}
+
+
+/* Reply of a cursor step, the next step is sent before the batch
+ * is given to LUA so it is in flight meanwhile */
+static void on_scan(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  scan_t* scan = (scan_t*)cb->data;
+  redisReply* r = (redisReply*)reply;
+
+  scan->in_flight = false;
+  scan->running++;
+
+  if (scan->done) {
+    /* Stopped while this step was in flight */
+  } else if (error != NULL) {
+    finish_scan(cc, scan, error);
+  } else if (r->type == REDIS_REPLY_ERROR) {
+    finish_scan(cc, scan, r->str);
+  } else if (r->type != REDIS_REPLY_ARRAY || r->elements != 2
+             || r->element[0]->type != REDIS_REPLY_STRING
+             || (r->element[1]->type != REDIS_REPLY_ARRAY
+                 && r->element[1]->type != REDIS_REPLY_SET)) {
+    finish_scan(cc, scan, "scan: Invalid reply");
+  } else {
+    redisReply* cursor = r->element[0];
+    redisReply* elements = r->element[1];
+    bool last = (cursor->len == 1 && cursor->str[0] == '0');
+
+    const char* step_error = NULL;
+    if (!last) {
+      int status = scan_step(cc, scan, cursor->str, cursor->len);
+      if (status < 0) {
+        step_error = uv_strerror(status);
+      }
+    }
+
+    /* An empty batch is not given */
+    bool stop = false;
+    if (elements->elements > 0) {
+      scan->count += elements->elements;
+      lua_State *L = cc->L;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, scan->batch_ref);
+      push_command_reply(cc, L, elements);
+      if (lua_pcall(L, 1, 1, 0) == 0) {
+        stop = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+      }
+      lua_pop(L, 1);
+    }
+
+    if (last || stop || step_error != NULL) {
+      finish_scan(cc, scan, step_error);
+    }
+  }
+
+  scan->running--;
+  release_scan(scan);
+}
+
+
+static void bulk_fill(client_context_t* cc, bulk_t* bulk);
+
+
+/* Free a bulk once nothing refers to it */
+static void release_bulk(bulk_t* bulk) {
+
+  if (!bulk->done || bulk->in_flight > 0 || bulk->nb_windows > 0
+      || bulk->running > 0) {
+    return;
+  }
+  sdsfree(bulk->error);
+  free(bulk);
+}
+
+
+/* Call the done callback (err, report) once */
+static void finish_bulk(client_context_t* cc, bulk_t* bulk, const char* error) {
+
+  if (bulk->done) {
+    return;
+  }
+  bulk->done = true;
+
+  lua_State *L = cc->L;
+  luaL_unref(L, LUA_REGISTRYINDEX, bulk->source_ref);
+  if (bulk->done_ref == LUA_NOREF || bulk->done_ref == LUA_REFNIL) {
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, bulk->done_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, bulk->done_ref);
+  if (error != NULL) {
+    lua_pushstring(L, error);
+  } else {
+    lua_pushnil(L);
+  }
+
+  double elapsed = (uv_hrtime() - bulk->start) / 1e6;
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, bulk->sent);
+  lua_setfield(L, -2, "commands");
+  lua_pushnumber(L, bulk->nb_errors);
+  lua_setfield(L, -2, "errors");
+  if (bulk->error != NULL) {
+    lua_pushlstring(L, bulk->error, sdslen(bulk->error));
+    lua_setfield(L, -2, "error");
+  }
+  lua_pushnumber(L, elapsed);
+  lua_setfield(L, -2, "elapsed_ms");
+  lua_pushnumber(L, elapsed > 0 ? bulk->sent * 1000 / elapsed : 0);
+  lua_setfield(L, -2, "per_second");
+  lua_pcall(L, 2, 0, 0);
+}
+
+
+static void check_bulk_end(client_context_t* cc, bulk_t* bulk) {
+
+  if (bulk->exhausted && bulk->in_flight == 0 && bulk->nb_windows == 0) {
+    finish_bulk(cc, bulk, NULL);
+  }
+}
+
+
+/* Reply of a bulk command, only the errors are kept */
+static void on_bulk_reply(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  bulk_t* bulk = (bulk_t*)cb->data;
+  redisReply* r = (redisReply*)reply;
+
+  bulk->in_flight--;
+  if (error != NULL) {
+    finish_bulk(cc, bulk, error);
+  } else if (r->type == REDIS_REPLY_ERROR) {
+    bulk->nb_errors++;
+    if (bulk->error == NULL) {
+      bulk->error = sdsnewlen(r->str, r->len);
+    }
+  }
+
+  /* Refill at half window */
+  if (bulk->in_flight <= bulk->window / 2) {
+    bulk_fill(cc, bulk);
+  }
+  if (!bulk->done) {
+    check_bulk_end(cc, bulk);
+  }
+  release_bulk(bulk);
+}
+
+
+/* CLIENT REPLY ON at the end of a window, the whole window is done */
+static void on_bulk_window(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+  bulk_t* bulk = (bulk_t*)cb->data;
+
+  bulk->windows[0] = bulk->windows[1];
+  bulk->nb_windows--;
+  if (error != NULL) {
+    finish_bulk(cc, bulk, error);
+  }
+
+  bulk_fill(cc, bulk);
+  if (!bulk->done) {
+    check_bulk_end(cc, bulk);
+  }
+  release_bulk(bulk);
+}
+
+
+/* Append a command to a write buffer */
+static int append_command(char** buf, size_t* len, size_t* size,
+                          int argc, const char** argv, const size_t* argvlen) {
+
+  char* cmd;
+  int cmd_len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+  if (cmd_len < 0) {
+    return SNAIL_ERR;
+  }
+
+  if (*len + cmd_len > *size) {
+    size_t size2 = (*size == 0) ? 4096 : *size;
+    while (size2 < *len + cmd_len) {
+      size2 *= 2;
+    }
+    char* buf2 = (char*)realloc(*buf, size2);
+    if (buf2 == NULL) {
+      free(cmd);
+      return SNAIL_ERR;
+    }
+    *buf = buf2;
+    *size = size2;
+  }
+  memcpy(*buf + *len, cmd, cmd_len);
+  *len += cmd_len;
+  free(cmd);
+  return SNAIL_OK;
+}
+
+
+/* Send the next commands of a bulk in one write, up to the window */
+static void bulk_fill(client_context_t* cc, bulk_t* bulk) {
+
+  static const char *argv[LUA_MAX_STACK];
+  static size_t argvlen[LUA_MAX_STACK];
+  static const char *reply_off[] = {"CLIENT", "REPLY", "OFF"};
+  static const char *reply_on[] = {"CLIENT", "REPLY", "ON"};
+
+  if (bulk->done || bulk->exhausted || !is_writable(cc)) {
+    return;
+  }
+  if (bulk->reply_off ? bulk->nb_windows >= 2 : bulk->in_flight >= bulk->window) {
+    return;
+  }
+  size_t room = bulk->reply_off ? bulk->window : bulk->window - bulk->in_flight;
+
+  lua_State *L = cc->L;
+  char* buf = NULL;
+  size_t len = 0;
+  size_t size = 0;
+  size_t n = 0;
+  sds failure = NULL;
+  bulk->running++;
+
+  if (bulk->reply_off
+      && append_command(&buf, &len, &size, 3, reply_off, NULL) != 0) {
+    failure = sdsnew("bulk: Out Of Memory");
+  }
+
+  while (failure == NULL && n < room) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, bulk->source_ref);
+    if (bulk->iterator) {
+      if (lua_pcall(L, 0, 1, 0) != 0) {
+        failure = sdsnew(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        break;
+      }
+    } else {
+      lua_rawgeti(L, -1, ++bulk->index);
+      lua_remove(L, -2);
+    }
+
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      bulk->exhausted = true;
+      break;
+    }
+    int argc = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+    if (argc == 0 || argc > LUA_MAX_STACK - 1 || !lua_checkstack(L, argc)) {
+      failure = sdsnew("bulk: Not a command");
+      lua_pop(L, 1);
+      break;
+    }
+
+    /* The args stay on the stack until the command is formatted */
+    int j;
+    for (j = 0; j < argc && failure == NULL; j++) {
+      lua_rawgeti(L, -1 - j, j + 1);
+      argv[j] = lua_tolstring(L, -1, &argvlen[j]);
+      if (argv[j] == NULL) {
+        failure = sdsnew("bulk: Not a string or a number");
+      }
+    }
+    if (failure == NULL
+        && append_command(&buf, &len, &size, argc, argv, argvlen) != 0) {
+      failure = sdsnew("bulk: Out Of Memory");
+    }
+    lua_pop(L, j + 1);
+    n++;
+  }
+
+  if (failure != NULL || n == 0) {
+    free(buf);
+    n = 0;
+  } else {
+    /* Callbacks ready before the write, a reply cannot lack one */
+    callback_ends_t pending = {NULL, NULL};
+    callback_ends_t* list = &pending;
+    size_t nb_cbs = bulk->reply_off ? 1 : n;
+    size_t i;
+    for (i = 0; i < nb_cbs && failure == NULL; i++) {
+      callback_t* cb = NULL;
+      callback_ll_t* wrapper = NULL;
+      if (create_callback(&cb, LUA_NOREF, 0) != 0) {
+        failure = sdsnew("bulk: Out Of Memory");
+      } else if (wrap_cb(&wrapper, cb) != 0) {
+        destroy_callback(cb);
+        failure = sdsnew("bulk: Out Of Memory");
+      } else {
+        cb->fn = bulk->reply_off ? on_bulk_window : on_bulk_reply;
+        cb->data = bulk;
+        push_cb(&list, wrapper);
+      }
+    }
+
+    if (failure == NULL && bulk->reply_off
+        && append_command(&buf, &len, &size, 3, reply_on, NULL) != 0) {
+      failure = sdsnew("bulk: Out Of Memory");
+    }
+
+    int r = 0;
+    if (failure == NULL) {
+      if (cc->auto_batch) {
+        flush_batches(cc);
+      }
+      end_single_flight(cc);
+      r = write_command(cc->stream, buf, len);
+      if (r < 0) {
+        failure = sdsnew(uv_strerror(r));
+      }
+    } else {
+      free(buf);
+    }
+
+    if (failure != NULL) {
+      destroy_list(&list);
+      n = 0;
+    } else {
+      if (cc->command_cb_list->tail != NULL) {
+        cc->command_cb_list->tail->next = pending.head;
+      } else {
+        cc->command_cb_list->head = pending.head;
+      }
+      cc->command_cb_list->tail = pending.tail;
+      cc->nb_pending += nb_cbs;
+      if (bulk->reply_off) {
+        bulk->windows[bulk->nb_windows++] = n;
+      } else {
+        bulk->in_flight += n;
+      }
+    }
+  }
+  bulk->sent += n;
+  cc->stats.commands += n;
+  bulk->running--;
+
+  if (failure != NULL) {
+    finish_bulk(cc, bulk, failure);
+    sdsfree(failure);
+  }
+}
+
+
+static int create_batch(batch_t** batch, const char* key, size_t key_len) {
+  assert(*batch == NULL);
+
+  *batch = (batch_t*)malloc(sizeof(batch_t));
+  if (*batch == NULL) {
+    return SNAIL_ERR;
+  }
+  (*batch)->key = key != NULL ? sdsnewlen(key, key_len) : NULL;
+  (*batch)->argc = 0;
+  (*batch)->size = 16;
+  (*batch)->argv = (sds*)malloc((*batch)->size * sizeof(sds));
+  (*batch)->cb = NULL;
+  (*batch)->next = NULL;
+  if ((*batch)->argv == NULL
+      || create_callback(&(*batch)->cb, LUA_NOREF, 0) != 0) {
+    return SNAIL_ERR;
+  }
+  (*batch)->cb->flags |= CALLBACK_BATCH;
+
+  if (key != NULL) {
+    (*batch)->argv[(*batch)->argc++] = sdsnew("HMGET");
+    (*batch)->argv[(*batch)->argc++] = sdsdup((*batch)->key);
+  } else {
+    (*batch)->argv[(*batch)->argc++] = sdsnew("MGET");
+  }
+
+  return SNAIL_OK;
+}
+
+
+static void destroy_batch(batch_t* batch) {
+  assert(batch != NULL);
+
+  int i;
+  for (i = 0; i < batch->argc; i++) {
+    sdsfree(batch->argv[i]);
+  }
+  free(batch->argv);
+  if (batch->key != NULL) {
+    sdsfree(batch->key);
+  }
+  free(batch);
+}
+
+
+static void on_batch_check(uv_check_t* handle);
+
+/* Queue a GET/HGET in the batch of its hash */
+static int batch_command(client_context_t* cc, const char* key, size_t key_len,
+                         const char* arg, size_t arg_len, int ref) {
+
+  batch_t* batch = cc->batches;
+  while (batch != NULL) {
+    if (key == NULL ? batch->key == NULL
+        : (batch->key != NULL && sdslen(batch->key) == key_len
+           && memcmp(batch->key, key, key_len) == 0)) {
+      break;
+    }
+    batch = batch->next;
+  }
+
+  if (batch == NULL) {
+    if (create_batch(&batch, key, key_len) != 0) {
+      return SNAIL_ERR;
+    }
+    batch->next = cc->batches;
+    cc->batches = batch;
+  }
+
+  if (batch->argc == batch->size) {
+    sds* argv = (sds*)realloc(batch->argv, batch->size * 2 * sizeof(sds));
+    if (argv == NULL) {
+      return SNAIL_ERR;
+    }
+    batch->argv = argv;
+    batch->size *= 2;
+  }
+
+  callback_t* cb = NULL;
+  if (create_callback(&cb, ref, 0) != 0
+      || add_child(batch->cb, cb) != 0) {
+    return SNAIL_ERR;
+  }
+  batch->argv[batch->argc++] = sdsnewlen(arg, arg_len);
+
+  /* Flushed at the end of the loop iteration */
+  if (cc->batch_check == NULL) {
+    cc->batch_check = (uv_check_t*)malloc(sizeof(uv_check_t));
+    if (cc->batch_check == NULL) {
+      return SNAIL_ERR;
+    }
+    uv_check_init(cc->stream->loop, cc->batch_check);
+    cc->batch_check->data = cc;
+  }
+  if (!uv_is_active((uv_handle_t*)cc->batch_check)) {
+    uv_check_start(cc->batch_check, on_batch_check);
+  }
+
+  return SNAIL_OK;
+}
+
+
+/* Call the batched callbacks with an error, silently if NULL */
+static void discard_batches(client_context_t* cc, const char* error) {
+
+  batch_t* batch;
+  while ((batch = cc->batches) != NULL) {
+    cc->batches = batch->next;
+    if (error != NULL) {
+      complete_callback(cc, batch->cb, NULL, error);
+    }
+    destroy_callback(batch->cb);
+    destroy_batch(batch);
+  }
+  if (cc->batch_check != NULL) {
+    uv_check_stop(cc->batch_check);
+  }
+}
+
+
+/* Write the pending MGET/HMGET */
+static void flush_batches(client_context_t* cc) {
+
+  batch_t* batch;
+  while ((batch = cc->batches) != NULL) {
+    cc->batches = batch->next;
+
+    int i;
+    int len = -1;
+    char *cmd = NULL;
+    size_t* argvlen = (size_t*)malloc(batch->argc * sizeof(size_t));
+    if (argvlen != NULL) {
+      for (i = 0; i < batch->argc; i++) {
+        argvlen[i] = sdslen(batch->argv[i]);
+      }
+      len = redisFormatCommandArgv(&cmd, batch->argc,
+                                   (const char**)batch->argv, argvlen);
+      free(argvlen);
+    }
+
+    callback_t* cb = batch->cb;
+    int r = len < 0 ? UV_ENOMEM : write_command(cc->stream, cmd, len);
+    if (r < 0) {
+      complete_callback(cc, cb, NULL, uv_strerror(r));
+      destroy_callback(cb);
+    } else {
+      callback_ll_t* wrapper = NULL;
+      if (wrap_cb(&wrapper, cb) == 0) {
+        push_cb(&cc->command_cb_list, wrapper);
+        cc->nb_pending++;
+        if (cc->timeout > 0) {
+          watch_timeout(cc, cb, cc->timeout);
+        }
+      }
+    }
+    destroy_batch(batch);
+  }
+  if (cc->batch_check != NULL) {
+    uv_check_stop(cc->batch_check);
+  }
+}
+
+
+static void on_batch_check(uv_check_t* handle) {
+
+  client_context_t* cc = (client_context_t*)handle->data;
+
+  if (is_writable(cc)) {
+    flush_batches(cc);
+  } else {
+    discard_batches(cc, "command: Not connected");
+  }
+}
+
+
+static void on_close_free(uv_handle_t* handle) {
+  free(handle);
+}
+
+
+static void on_timer(uv_timer_t* handle) {
+
+  client_context_t* cc = (client_context_t*)handle->data;
+
+  if (cc->flags & REDIS_DISCONNECTING) {
+    return;
+  }
+
+  node_t* leaf = NULL;
+  char name[48];
+
+  search_timer(handle->repeat, cc->timers, &leaf);
+  snprintf(name, sizeof(name), TIMER_EVENT "%" PRIu64, handle->repeat);
+
+  callback_ll_t *temp = leaf->cb_list->head;
+  while(temp != NULL) {
+
+    lua_State *L = cc->L;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, temp->cb->ref);
+
+    if (!(temp->cb->flags & CALLBACK_INITIALIZED)) {
+      lua_pushstring(L, "event received but not initialized");
+      lua_pcall(L, 1, 0, 0);
+    } else {
+      lua_pushnil(L);
+      lua_createtable(L, 3, 0);
+      lua_pushstring(L, "timer");
+      lua_rawseti(L, -2, 1);
+      lua_pushinteger(L, handle->repeat);
+      lua_rawseti(L, -2, 2);
+      lua_pushinteger(L, handle->timeout);
+      lua_rawseti(L, -2, 3);
+      timed_pcall(cc, 2, leaf, name);
+    }
+    temp = temp->next;
+  }
+}
+
+
+static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+
+  client_context_t* cc = (client_context_t*)stream->data;
+  /* RESP3 carries replies and push notifications on one stream */
+  bool sub_mode = (cc->sub_stream == stream) && !cc->resp3;
+  redisReader *reader = sub_mode ? cc->sub_reader : cc->reader;
+  SNAIL_PROBE3(read, cc, stream, nread);
+
+  if (cc->flags & REDIS_DISCONNECTING) {
+    buf_free(buf);
+    return;
+  }
+
+  /* Nothing to parse, give the buffer back */
+  if (nread <= 0 && buf->base != NULL) {
+    buf_free(buf);
+  }
+
+  /* Error or connection closed by server */
+  if (nread < 0) {
+    /* Call Error Callback */
+    if (cc->r_error_cb != LUA_NOREF && cc->r_error_cb != LUA_REFNIL) {
+      const char* error = uv_strerror(nread);
+      lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_error_cb);
+      lua_pushstring(cc->L, error);
+      lua_pcall(cc->L, 1, 0, 0);
+    }
+    /* Disconnect */
+    uv_close((uv_handle_t*)stream, on_disconnect);
+    return;
+  }
+
+  if (nread > 0) {
+    cc->stats.bytes_in += nread;
+    cc->read_time = uv_hrtime();
+    if (cc->capture != NULL) {
+      capture_bytes(cc, stream, CAPTURE_READ, buf->base, nread);
+    }
+    if (redisReaderFeed(reader,buf->base,nread) != REDIS_OK) {
+      /* Call Error Callback */
+      emit_error(cc, reader->errstr);
+      buf_free(buf);
+      return;
+    }
+
+    buf_free(buf);
+
+    void *reply = NULL;
+    int status;
+    while ((status = redisReaderGetReply(reader,&reply)) == REDIS_OK) {
+      if (reply == NULL) {
+        /* When the connection is being disconnected and there are
+         * no more replies, this is the cue to really disconnect. */
+        if (cc->flags & REDIS_DISCONNECTING) {
+          //__redisAsyncDisconnect(ac);
+          return;
+        }
+
+        /* When the connection is not being disconnected, simply stop
+         * trying to get replies and wait for the next loop tick. */
+        break;
+      }
+
+      if (sub_mode && (cc->durable != NULL
+                       || ((redisReply*)reply)->type != REDIS_REPLY_ARRAY)
+          && cc->sub_cb_list->head != NULL) {
+        /* Reply to an internal command of the pub/sub stream */
+        callback_t *cb = cc->sub_cb_list->head->cb;
+        cb->attach++;
+        shift_cb(&cc->sub_cb_list, NULL);
+        complete_callback(cc, cb, reply, NULL);
+        release_callback(cb);
+        reader->fn->freeObject(reply);
+      } else if (sub_mode || ((redisReply*)reply)->type == REDIS_REPLY_PUSH) {
+	      if (((redisReply*)reply)->type == REDIS_REPLY_ERROR) {
+		      // disconnect??
+		    } else {
+		      get_and_call_sub_cb(cc, reply);
+	      }
+        reader->fn->freeObject(reply);
+      } else if ((cc->flags & REDIS_MONITORING)
+          && cc->command_cb_list->head != NULL) {
+        /* Monitor mode, the callback stays for every reply */
+        callback_t *cb = cc->command_cb_list->head->cb;
+        if (cb->ref != LUA_NOREF && cb->ref != LUA_REFNIL) {
+          lua_State *L = cc->L;
+          lua_rawgeti(L, LUA_REGISTRYINDEX, cb->ref);
+          lua_pushnil(L);
+          int argc = push_reply(L, reply);
+          timed_pcall(cc, argc + 1, NULL, "monitor");
+        }
+        reader->fn->freeObject(reply);
+      } else {
+        /* No callback for this reply. This can either be a NULL callback,
+         * a timed out command or there were no callbacks to begin with.
+         * Either way, don't abort with an error, but simply ignore it
+         * because the client doesn't know what the server will spit out
+         * over the wire. */
+        callback_t *cb = shift_command_cb(cc);
+        cc->stats.replies++;
+        if (((redisReply*)reply)->type == REDIS_REPLY_ERROR) {
+          cc->stats.errors++;
+        }
+        uint64_t latency = 0;
+        if (cb != NULL && cb->hist != NULL) {
+          latency = uv_hrtime() - cb->start;
+          hist_record(cb->hist, latency / 1000);
+        }
+        SNAIL_PROBE4(reply, cc, cb, ((redisReply*)reply)->type, latency);
+        if (cb != NULL) {
+          /* A late reply, its callback got the timeout error */
+          if (!(cb->flags & CALLBACK_TIMED_OUT)) {
+            complete_callback(cc, cb, reply, NULL);
+          }
+          release_callback(cb);
+        }
+        reader->fn->freeObject(reply);
+	    }
+      reply = NULL;
+    }
+
+    if (reply != NULL) {
+      reader->fn->freeObject(reply);
+    }
+    if (status == REDIS_ERR) {
+      //TODO disconnect?
+      return;
+    }
+
+    if (!sub_mode) {
+      check_drain(cc);
+    }
+  }
+}
+
+
+static void on_write(uv_write_t* handle, int status) {
+
+  uv_stream_t* stream = handle->handle;
+  client_context_t* cc = (client_context_t*)stream->data;
+
+  /* The command buffer is owned by the request until now */
+  free(handle->data);
+  req_free((uv_req_t*)handle);
+  SNAIL_PROBE3(write_done, cc, stream, status);
+
+  if (status < 0) {
+    /* Call Callback */
+    callback_t *cb = shift_command_cb(cc);
+    if (cb != NULL) {
+      complete_callback(cc, cb, NULL, uv_strerror(status));
+      release_callback(cb);
+    }
+    return;
+  }
+  assert(status == 0);
+
+  check_drain(cc);
+  return;
+}
+
+
+static void on_connect(uv_connect_t* handle, int status) {
+
+  client_context_t* cc = (client_context_t*)handle->data;
+  uv_stream_t* stream = handle->handle;
+  req_free((uv_req_t*)handle);
+  SNAIL_PROBE3(connect, cc, stream, status);
+
+  if (status < 0) {
+    /* Call Error Callback */
+    if (cc->r_error_cb != LUA_NOREF && cc->r_error_cb != LUA_REFNIL) {
+      const char* error = uv_strerror(status);
+      lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_error_cb);
+      lua_pushstring(cc->L, error);
+      lua_pcall(cc->L, 1, 0, 0);
+      return;
+    }
+
+    /* Disconnect */
+    uv_close((uv_handle_t*)cc->stream, on_disconnect);
+    return;
+  }
+  assert(status == 0);
+
+  /* Start Reading, the stream stays in read mode until closed */
+  int r = uv_read_start(stream, buf_alloc, on_read);
+  if (r < 0) {
+    /* Call Error Callback */
+    if (cc->r_error_cb != LUA_NOREF && cc->r_error_cb != LUA_REFNIL) {
+      lua_rawgeti(cc->L, LUA_REGISTRYINDEX, cc->r_error_cb);
+      lua_pushstring(cc->L, uv_strerror(r));
+      lua_pcall(cc->L, 1, 0, 0);
+    }
+    uv_close((uv_handle_t*)stream, on_disconnect);
+    return;
+  }
+
+  if (cc->resp3) {
+    /* One stream for both */
+    cc->stream_flags |= STREAM_CONNECTED | SUB_STREAM_CONNECTED;
+  } else if (!(cc->stream_flags & STREAM_CONNECTED)) {
+    cc->stream_flags |= STREAM_CONNECTED;
+  } else if ((cc->stream_flags & STREAM_CONNECTED)
+      && !(cc->stream_flags & SUB_STREAM_CONNECTED)) {
+    cc->stream_flags |= SUB_STREAM_CONNECTED;
+  }
+
+  if ((cc->stream_flags & STREAM_CONNECTED)
+      && (cc->stream_flags & SUB_STREAM_CONNECTED)) {
+    cc->flags |= REDIS_CONNECTED;
+
+    /* Switch the protocol before any other command */
+    if (cc->resp3) {
+      static const char *hello[] = {"HELLO", "3"};
+      callback_t* cb = NULL;
+      if (create_callback(&cb, LUA_NOREF, 0) == 0) {
+        cb->fn = on_hello;
+        r = send_command(cc, cc->stream, 2, hello, NULL, cb);
+        if (r < 0) {
+          emit_error(cc, uv_strerror(r));
+        }
+      }
+    }
+
+    /* Scripts cached again */
+    load_scripts(cc);
+
+    /* Notification latency canary */
+    if (cc->canary != NULL && cc->durable == NULL) {
+      r = canary_start(cc);
+      if (r < 0) {
+        emit_error(cc, uv_strerror(r));
+      }
+    }
+
+    /* Read the notifications stream */
+    if (cc->durable != NULL) {
+      r = durable_start(cc);
+      if (r < 0) {
+        emit_error(cc, uv_strerror(r));
+      }
+    }
+
+    /* Call Connect Callback, once tracking is on */
+    if (cc->tracking) {
+      r = start_tracking(cc);
+      if (r < 0) {
+        emit_error(cc, uv_strerror(r));
+        emit_connect(cc);
+      }
+    } else {
+      emit_connect(cc);
+    }
+  }
+  return;
+}
+
+
+/* Records replayed per loop iteration at full speed */
+#define REPLAY_RECORDS 1024
+
+static void on_replay_timer(uv_timer_t* handle);
+
+
+static void free_replay(client_context_t* cc, replay_t* replay) {
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (replay->readers[i] != NULL) {
+      redisReaderFree(replay->readers[i]);
+    }
+  }
+  capture_close(&replay->capture);
+  if (replay->timer != NULL) {
+    uv_close((uv_handle_t*)replay->timer, on_close_free);
+  }
+  if (replay->done_ref != LUA_NOREF && replay->done_ref != LUA_REFNIL) {
+    luaL_unref(cc->L, LUA_REGISTRYINDEX, replay->done_ref);
+  }
+  free(replay);
+}
+
+
+/* Stop the replay without the done callback */
+static void stop_replay(client_context_t* cc) {
+
+  replay_t* replay = cc->replay;
+  if (replay == NULL) {
+    return;
+  }
+  cc->replay = NULL;
+  replay->stopped = true;
+  if (!replay->running) {
+    free_replay(cc, replay);
+  }
+}
+
+
+/* Call the done callback (err, report) and free the replay */
+static void finish_replay(client_context_t* cc, const char* error) {
+
+  replay_t* replay = cc->replay;
+  lua_State *L = cc->L;
+  cc->replay = NULL;
+
+  int done_ref = replay->done_ref;
+  replay->done_ref = LUA_NOREF;
+  if (done_ref == LUA_NOREF || done_ref == LUA_REFNIL) {
+    free_replay(cc, replay);
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, done_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, done_ref);
+  if (error != NULL) {
+    lua_pushstring(L, error);
+  } else {
+    lua_pushnil(L);
+  }
+
+  double elapsed = (uv_hrtime() - replay->start) / 1e6;
+  lua_createtable(L, 0, 6);
+  lua_pushnumber(L, replay->records);
+  lua_setfield(L, -2, "records");
+  lua_pushnumber(L, replay->bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, replay->replies);
+  lua_setfield(L, -2, "replies");
+  lua_pushnumber(L, replay->messages);
+  lua_setfield(L, -2, "messages");
+  lua_pushnumber(L, elapsed);
+  lua_setfield(L, -2, "elapsed_ms");
+  lua_pushnumber(L, elapsed > 0 ? replay->replies * 1000 / elapsed : 0);
+  lua_setfield(L, -2, "per_second");
+  free_replay(cc, replay);
+  lua_pcall(L, 2, 0, 0);
+}
+
+
+/* Messages go to the subscription callbacks, other replies are only parsed */
+static void replay_reply(client_context_t* cc, replay_t* replay,
+                         redisReply* reply, int stream) {
+
+  replay->replies++;
+  if (reply->type != REDIS_REPLY_PUSH
+      && !(reply->type == REDIS_REPLY_ARRAY && stream == CAPTURE_SUB_STREAM)) {
+    return;
+  }
+  if (reply->elements < 3 || reply->element[0]->type != REDIS_REPLY_STRING) {
+    return;
+  }
+  const char* type = reply->element[0]->str;
+  if (strcmp(type, "message") == 0 || strcmp(type, "pmessage") == 0) {
+    replay->messages++;
+    get_and_call_sub_cb(cc, reply);
+  }
+}
+
+
+/* Feed the due records, then wait for the next one */
+static void on_replay_timer(uv_timer_t* handle) {
+
+  client_context_t* cc = (client_context_t*)handle->data;
+  replay_t* replay = cc->replay;
+  if (replay == NULL) {
+    return;
+  }
+
+  uint64_t now = uv_hrtime() - replay->start;
+  const char* error = NULL;
+  bool waiting = false;
+  int n = 0;
+
+  replay->running = true;
+  while (!replay->stopped) {
+    if (!replay->pending) {
+      int r = capture_next(replay->capture, &replay->record);
+      if (r < 0) {
+        error = uv_strerror(r);
+      }
+      if (r <= 0) {
+        break;
+      }
+      replay->pending = true;
+    }
+
+    capture_record_t* record = &replay->record;
+    if (replay->realtime && record->time > now) {
+      uv_timer_start(handle, on_replay_timer,
+                     (record->time - now + 999999) / 1000000, 0);
+      waiting = true;
+      break;
+    }
+    if (!replay->realtime && n == REPLAY_RECORDS) {
+      uv_timer_start(handle, on_replay_timer, 0, 0);
+      waiting = true;
+      break;
+    }
+    replay->pending = false;
+    replay->records++;
+    n++;
+    if (record->dir != CAPTURE_READ) {
+      continue;
+    }
+
+    replay->bytes += record->len;
+    redisReader* reader = replay->readers[record->stream & 1];
+    if (redisReaderFeed(reader, replay->capture->buf, record->len) != REDIS_OK) {
+      error = reader->errstr;
+      break;
+    }
+    void* reply = NULL;
+    while (!replay->stopped
+           && redisReaderGetReply(reader, &reply) == REDIS_OK && reply != NULL) {
+      replay_reply(cc, replay, (redisReply*)reply, record->stream);
+      reader->fn->freeObject(reply);
+      reply = NULL;
+    }
+  }
+  replay->running = false;
+
+  if (replay->stopped) {
+    free_replay(cc, replay);
+  } else if (!waiting) {
+    finish_replay(cc, error);
+  }
+}
+
+
+static int lua_client_command(lua_State *L) {
+#ifdef LUA_STACK_CHECK
+  //stackDump(L);
+  int top = lua_gettop(L);
+#endif
+  static const char *argv[LUA_MAX_STACK];
+  static size_t argvlen[LUA_MAX_STACK];
+  static const char *timers[100];
+
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+
+  int argc, i, nb_timers;
+  argc = 0;
+  nb_timers = 0;
+  /* Is there callback? */
+  int ltop = has_callback(L) ? lua_gettop(L) -1 : lua_gettop(L);
+
+  /* Is there a command timeout? */
+  int first = 2;
+  uint64_t timeout = cc->timeout;
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    /* Stored in ms, a fraction of ms would mean no timeout */
+    if (lua_tonumber(L, 2) < 1) {
+      return luaL_argerror(L, 2, "command: Timeout must be >= 1");
+    }
+    timeout = lua_tointeger(L, 2);
+    first = 3;
+  }
 
   /* Redis cmd */
-  for (i = 2; i <= ltop; i++) {
+  for (i = first; i <= ltop; i++) {
+    if (lua_istable(L, i)) {
+      int j;
+      int length = lua_objlen(L, i);
+      for (j = 0; j < length; j++) {
+        lua_rawgeti(L, i, j + 1);
+        argv[argc] = lua_tolstring(L, -1, &argvlen[argc]);
+        lua_pop(L, 1);
+
+        if (argv[argc] == NULL) {
+          return luaL_argerror(L, i, "command: Not a string or a number");
+        }
+
+        if (++argc > LUA_MAX_STACK - 1) {
+          return luaL_error(L, "command: Stack Overflow");
+        }
+      }
+    } else {
+      size_t key_s;
+      const char * key = lua_tolstring(L, i, &key_s);
+      /* Remove timer key */
+      if (strncmp(key, TIMER_EVENT, strlen(TIMER_EVENT)) != 0) {
+        argv[argc] = key;
+        argvlen[argc] = key_s;
+        if (argv[argc] == NULL) {
+          return luaL_argerror(L, i, "command: Not a string or a number");
+        }
+
+        if (++argc > LUA_MAX_STACK - 1) {
+          return luaL_error(L, "command: Stack Overflow");
+        }
+      } else {
+        timers[nb_timers++] = key;
+      }
+    }
+  }
+
+  if (argc == 0) {
+    return luaL_error(L, "command: No command");
+  }
+
+  /* Callback */
+  callback_t *cb = NULL;
+  int ref = LUA_REFNIL;
+
+  char *cmd = NULL;
+  int len = 0;
+
+  /* Single-flight, join an identical read already in flight.
+   * The formatted command is the key, binary args are not shared */
+  bool shared = false;
+  if (cc->single_flight && first == 2 && is_writable(cc)
+      && is_read_only(argv[0], argvlen[0])) {
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    shared = (len > 0 && memchr(cmd, '\0', len) == NULL);
+
+    callback_ends_t* leaders = NULL;
+    if (shared) {
+      search(cmd, cc->in_flight, &leaders);
+    }
+    if (leaders != NULL && leaders->head != NULL) {
+      free(cmd);
+      if (has_callback(L)) {
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      }
+      if (create_callback(&cb, ref, 0) != 0
+          || add_child(leaders->head->cb, cb) != 0) {
+        return luaL_error(L, "command: Out Of Memory");
+      }
+      lua_pushvalue(L, 1);
+      lua_pushboolean(L, !above_high_water(cc, cc->stream));
+      return 2;
+    }
+  }
+
+  /* Merge single key reads into MGET/HMGET until the end of the loop
+   * iteration, other commands flush them to keep the order */
+  if (cc->auto_batch && is_writable(cc)) {
+    bool get = (argc == 2 && argvlen[0] == 3
+                && strncasecmp(argv[0], "get", 3) == 0);
+    bool hget = (argc == 3 && argvlen[0] == 4
+                 && strncasecmp(argv[0], "hget", 4) == 0);
+
+    if ((get || hget) && first == 2) {
+      if (has_callback(L)) {
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      }
+      if (cmd != NULL) {
+        free(cmd);
+      }
+      if (batch_command(cc, hget ? argv[1] : NULL, hget ? argvlen[1] : 0,
+                        argv[argc - 1], argvlen[argc - 1], ref) != 0) {
+        return luaL_error(L, "command: Out Of Memory");
+      }
+      lua_pushvalue(L, 1);
+      lua_pushboolean(L, !above_high_water(cc, cc->stream));
+      return 2;
+    }
+    flush_batches(cc);
+  }
+
+  if (cmd == NULL) {
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+  }
+
+  if (has_callback(L)) {
+    ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  int pvariant = (tolower(argv[0][0]) == 'p') ? 1 : 0;
+  bool sub_mode = false;
+
+  if (strncasecmp(argv[0] + pvariant,"subscribe",9) == 0) {
+	  sub_mode = true;
+
+    /* Create callback with channels */
+    if (create_callback(&cb, ref, argc - 1 + nb_timers) == 0) {
+      /* Add every channel/pattern to the list of subscription callbacks. */
+      int k;
+      for (k = 1; k <= argc-1; k++) {
+	      /* Create channel */
+	      channel_t *ch = NULL;
+        if (create_channel(&ch, argv[k]) == 0) {
+          cb->channels[k-1] = ch;
+	      }
+        /* Add to list/tree */
+        node_t *leaf = NULL;
+        if (pvariant) {
+          insert(&(cc->patterns), &leaf, argv[k]);
+        } else {
+          insert(&(cc->channels), &leaf, argv[k]);
+        }
+
+        callback_ll_t* wrapper = NULL;
+        if (wrap_cb(&wrapper, cb) == 0) {
+          push_cb(&(leaf->cb_list), wrapper);
+	      }
+      }
+      for (k = 0; k <= nb_timers -1; k++) {
+        const char *key = timers[k];
+        uint64_t ikey = strtol(key + strlen(TIMER_EVENT), (char **)NULL, 10);
+        /* Create channel */
+	      channel_t *ch = NULL;
+        if (create_timer_channel(&ch, ikey) == 0) {
+          cb->channels[argc - 1 + k] = ch;
+	      }
+
+        int status;
+        /* Add to list/tree */
+        node_t *leaf = NULL;
+        if ( (status = insert_timer(&(cc->timers), &leaf, ikey)) >= 1) {
+          if (status != 2) {
+            ch->flags |= CHANNEL_SUBSCRIBED;
+          }
+
+          callback_ll_t* wrapper = NULL;
+          if (wrap_cb(&wrapper, cb) == 0) {
+            push_cb(&(leaf->cb_list), wrapper);
+	        }
+        }
+      }
+    }
+  } else if (strncasecmp(argv[0] + pvariant,"unsubscribe",11) == 0) {
+    sub_mode = true;
+    /* It is only useful to call (P)UNSUBSCRIBE when the context is
+    * subscribed to one or more channels or patterns. */
+    if (!(cc->flags & REDIS_SUBSCRIBED)) {
+      //return REDIS_ERR;
+    }
+    /* (P)UNSUBSCRIBE does not have its own response: every channel or
+     * pattern that is unsubscribed will receive a message. This means we
+    * should not append a callback function for this command. */
+  } else {
+
+    if (strncasecmp(argv[0],"monitor",7) == 0) {
+      /* Set monitor flag and push callback */
+      cc->flags |= REDIS_MONITORING;
+    }
+
+    callback_ll_t* wrapper = NULL;
+    if ( create_callback(&cb, ref, 0) == 0
+      && wrap_cb(&wrapper, cb) == 0 ) {
+      push_cb(&cc->command_cb_list, wrapper);
+      cc->nb_pending++;
+
+      /* Single-flight leader */
+      if (shared) {
+        node_t *leaf = NULL;
+        callback_ll_t* leader = NULL;
+        if (insert(&cc->in_flight, &leaf, cmd) == 0
+            && wrap_cb(&leader, cb) == 0) {
+          push_cb(&leaf->cb_list, leader);
+          cb->key = strdup(cmd);
+        }
+      }
+    }
+  }
+
+  /* Durable mode, the subscriptions are fed from the stream */
+  if (sub_mode && cc->durable != NULL) {
+    free(cmd);
+    if (cb != NULL) {
+      int k;
+      for (k = 1; k <= argc - 1; k++) {
+        redisReply count;
+        memset(&count, 0, sizeof(count));
+        count.type = REDIS_REPLY_INTEGER;
+        count.integer = k;
+        dispatch_sub_reply(cc, pvariant ? "psubscribe" : "subscribe",
+                           argv[k], argvlen[k], &count);
+      }
+      /* Timers only, no subscribe reply starts them */
+      if (argc == 1 && nb_timers > 0) {
+        for (k = 0; k <= nb_timers - 1; k++) {
+          channel_t* ch = cb->channels[k];
+          if (ch != NULL && !(ch->flags & CHANNEL_SUBSCRIBED)) {
+            start_timer_channel(cc, ch);
+          }
+        }
+        cb->flags |= CALLBACK_INITIALIZED;
+      }
+    }
+    lua_pushvalue(L, 1);
+    lua_pushboolean(L, 1);
+    return 2;
+  }
+
+  /* Notifications needed by the subscriptions */
+  int r = 0;
+  if (sub_mode && cc->auto_notify_config && is_writable(cc)) {
+    r = update_notify_config(cc);
+    if (r < 0) {
+      emit_error(cc, uv_strerror(r));
+    }
+  }
+
+  /* Start Writing */
+  uv_stream_t* stream = sub_mode ? cc->sub_stream : cc->stream;
+  if (is_writable(cc)) {
+    if (!shared && !is_read_only(argv[0], argvlen[0])) {
+      end_single_flight(cc);
+    }
+    r = write_command(stream, cmd, len);
+  } else {
+    free(cmd);
+  }
+
+  /* Error */
+  if (!is_writable(cc) || r < 0) {
+
+   const char* error = r < 0 ?
+				  uv_strerror(r)
+				  : "command: Not connected";
+
+    /* Unref and call the callback (if there is) with error */
+    callback_t *pending = shift_command_cb(cc);
+    if (pending != NULL) {
+      if (pending->ref != LUA_NOREF && pending->ref != LUA_REFNIL) {
+        complete_callback(cc, pending, NULL, error);
+        release_callback(pending);
+        return 0;
+      }
+      release_callback(pending);
+    } else if (sub_mode) {
+      // TODO: crash badly
+    }
+
+#ifdef LUA_STACK_CHECK
+    assert(lua_gettop(L) == top - 1);
+#endif
+    /* If no error callback, print stack trace */
+    return luaL_error(L, error);
+  }
+  assert(r == 0);
+
+  if (!sub_mode) {
+    cc->stats.commands++;
+    if (cb != NULL) {
+      cb->hist = stats_histogram(&cc->stats, argv[0], argvlen[0]);
+      cb->start = uv_hrtime();
+      SNAIL_PROBE3(command, cc, cb, cb->hist ? cb->hist->name : NULL);
+    }
+  }
+
+  /* Watch the deadline */
+  if (!sub_mode && cb != NULL && timeout > 0
+      && !(cc->flags & REDIS_MONITORING)) {
+    if (watch_timeout(cc, cb, timeout) != 0) {
+      return luaL_error(L, "command: Out Of Memory");
+    }
+  }
+
+  lua_pushvalue(L, 1);
+#ifdef LUA_STACK_CHECK
+  assert(lua_gettop(L) == top);
+#endif
+  /* false when the caller should wait for the drain event */
+  lua_pushboolean(L, !above_high_water(cc, stream));
+  return 2;
+}
+
+
+/* Fire-and-forget, CLIENT REPLY SKIP is sent in the same write */
+static int lua_client_send(lua_State *L) {
+
+  static const char *argv[LUA_MAX_STACK];
+  static size_t argvlen[LUA_MAX_STACK];
+  static const char *skip[] = {"CLIENT", "REPLY", "SKIP"};
+
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+
+  int argc = 0;
+  int i, top = lua_gettop(L);
+  for (i = 2; i <= top; i++) {
     if (lua_istable(L, i)) {
       int j;
       int length = lua_objlen(L, i);
+      /* The args stay on the stack until the command is formatted */
+      if (!lua_checkstack(L, length)) {
+        return luaL_error(L, "send: Stack Overflow");
+      }
       for (j = 0; j < length; j++) {
         lua_rawgeti(L, i, j + 1);
         argv[argc] = lua_tolstring(L, -1, &argvlen[argc]);
+        if (argv[argc] == NULL) {
+          return luaL_argerror(L, i, "send: Not a string or a number");
+        }
+        if (++argc > LUA_MAX_STACK - 1) {
+          return luaL_error(L, "send: Stack Overflow");
+        }
+      }
+    } else {
+      argv[argc] = lua_tolstring(L, i, &argvlen[argc]);
+      if (argv[argc] == NULL) {
+        return luaL_argerror(L, i, "send: Not a string or a number");
+      }
+      if (++argc > LUA_MAX_STACK - 1) {
+        return luaL_error(L, "send: Stack Overflow");
+      }
+    }
+  }
+
+  if (argc == 0) {
+    return luaL_error(L, "send: No command");
+  }
+  if (changes_reply_flow(argv[0], argvlen[0])) {
+    return luaL_argerror(L, 2, "send: Not with pub/sub or monitor");
+  }
+  if (!is_writable(cc)) {
+    return luaL_error(L, "send: Not connected");
+  }
+
+  /* Keep the order with the batched reads */
+  if (cc->auto_batch) {
+    flush_batches(cc);
+  }
+
+  char* buf = NULL;
+  size_t len = 0;
+  size_t size = 0;
+  if (append_command(&buf, &len, &size, 3, skip, NULL) != 0
+      || append_command(&buf, &len, &size, argc, argv, argvlen) != 0) {
+    free(buf);
+    return luaL_error(L, "send: Out Of Memory");
+  }
+
+  end_single_flight(cc);
+  int r = write_command(cc->stream, buf, len);
+  if (r < 0) {
+    return luaL_error(L, uv_strerror(r));
+  }
+  cc->stats.commands++;
+
+  lua_settop(L, 1);
+  lua_pushboolean(L, !above_high_water(cc, cc->stream));
+  return 2;
+}
+
+
+static int lua_client_call(lua_State *L) {
+
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+
+  /* The coroutine itself is the callback */
+  if (lua_pushthread(L)) {
+    return luaL_error(L, "call: Not in a coroutine");
+  }
+
+  /* Protected, cc->calling must not outlive a raised error */
+  int n = lua_gettop(L);
+  lua_pushcfunction(L, lua_client_command);
+  lua_insert(L, 1);
+  cc->calling = L;
+  cc->call_error = NULL;
+  int status = lua_pcall(L, n, 1, 0);
+  cc->calling = NULL;
+  if (status != 0) {
+    cc->call_error = NULL;
+    return lua_error(L);
+  }
+
+  if (cc->call_error != NULL) {
+    lua_pushstring(L, cc->call_error);
+    cc->call_error = NULL;
+    return 1;
+  }
+  /* Resumed with (err) or (nil, reply) */
+  return lua_yield(L, 0);
+}
+
+
+/* Check a call_all command as command would, nothing is sent if one is wrong */
+static int check_call(lua_State *L, int index) {
+
+  int length = lua_objlen(L, index);
+  int j, argc = 0;
+  for (j = 1; j <= length; j++) {
+    lua_rawgeti(L, index, j);
+    int type = lua_type(L, -1);
+    if (j == 1 && type == LUA_TNUMBER) {
+      if (lua_tonumber(L, -1) < 1) {
         lua_pop(L, 1);
+        return luaL_argerror(L, index, "call_all: Timeout must be >= 1");
+      }
+    } else if (type == LUA_TTABLE) {
+      int k, nested = lua_objlen(L, -1);
+      for (k = 1; k <= nested; k++) {
+        lua_rawgeti(L, -1, k);
+        type = lua_type(L, -1);
+        lua_pop(L, 1);
+        if (type != LUA_TSTRING && type != LUA_TNUMBER) {
+          lua_pop(L, 1);
+          return luaL_argerror(L, index, "call_all: Not a string or a number");
+        }
+      }
+      argc += nested;
+    } else if (type == LUA_TSTRING || type == LUA_TNUMBER) {
+      argc++;
+    } else {
+      lua_pop(L, 1);
+      return luaL_argerror(L, index, "call_all: Not a string or a number");
+    }
+    lua_pop(L, 1);
+  }
+  if (argc == 0) {
+    return luaL_argerror(L, index, "call_all: No command");
+  }
+  if (argc > LUA_MAX_STACK - 1) {
+    return luaL_argerror(L, index, "call_all: Stack Overflow");
+  }
+  return 0;
+}
+
+
+static int lua_client_call_all(lua_State *L) {
+
+  luaL_checkudata(L, 1, LUA_CLIENT_MT);
+  int top = lua_gettop(L);
+  int i, j;
+
+  /* Before the join is created, it would leak on an error */
+  for (i = 2; i <= top; i++) {
+    luaL_checktype(L, i, LUA_TTABLE);
+    check_call(L, i);
+  }
+  if (lua_pushthread(L)) {
+    return luaL_error(L, "call_all: Not in a coroutine");
+  }
+
+  join_t* join = (join_t*)malloc(sizeof(join_t));
+  if (join == NULL) {
+    return luaL_error(L, "call_all: Out Of Memory");
+  }
+  join->thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_createtable(L, top - 1, 0);
+  join->replies_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  join->errors_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  join->remaining = top - 1;
+  join->nb_errors = 0;
+  join->waiting = false;
+
+  /* snail:command(cmd..., slot) for each table */
+  for (i = 2; i <= top; i++) {
+    int length = lua_objlen(L, i);
+    lua_pushcfunction(L, lua_client_command);
+    lua_pushvalue(L, 1);
+    for (j = 1; j <= length; j++) {
+      lua_rawgeti(L, i, j);
+    }
+    join_slot_t* slot = (join_slot_t*)lua_newuserdata(L, sizeof(join_slot_t));
+    slot->join = join;
+    slot->index = i - 1;
+    luaL_getmetatable(L, LUA_JOIN_MT);
+    lua_setmetatable(L, -2);
+    lua_call(L, length + 2, 0);
+  }
+
+  /* Every command failed */
+  if (join->remaining == 0) {
+    push_join(L, join);
+    return 2;
+  }
+  /* Resumed with (replies, errors or nil) */
+  join->waiting = true;
+  return lua_yield(L, 0);
+}
+
+
+static int lua_client_subscribe(lua_State *L) {
+#ifdef LUA_STACK_CHECK
+  int vtop = lua_gettop(L);
+#endif
+
+  int top = lua_gettop(L);
+
+  int key_space_prefix_len = strlen(KEY_SPACE);
+  int key_event_prefix_len = strlen(KEY_EVENT);
+  int timer_event_prefix_len = strlen(TIMER_EVENT);
+
+  int i;
+  for (i = 2; i <= top -1; i++) {
+    const char *key;
+    char* buffer;
+    /* Is it a number */
+    bool is_number = false;
+    bool add_prefix = false;
+    if (lua_isnumber (L, i)) {
+      is_number = true;
+      add_prefix = true;
+      int timeout = luaL_checkint(L, i);
+      int len = (timeout == 0 ? 1 : (int)(log10(timeout)+1));
+      buffer = malloc((len + 1) * sizeof(char));
+      snprintf(buffer, len + 1, "%d", timeout);
+      key = buffer;
+    } else {
+      key = luaL_checkstring(L, i);
+      /* Add prefix if needed */
+      add_prefix = !(strncmp(key, KEY_SPACE, key_space_prefix_len) == 0
+              || strncmp(key, KEY_EVENT, key_event_prefix_len) == 0
+              || strncmp(key, TIMER_EVENT, timer_event_prefix_len) == 0);
+    }
+
+    if (add_prefix) {
+      /* Is it an event ? */
+      int j;
+      bool event = false;
+      for (j = 0; j <= NB_EVENTS - 1; j++) {
+	      if (strcmp(events[j], key) == 0) {
+		      event = true;
+		      break;
+	      }
+	    }
+
+      char *newkey = malloc((strlen(is_number ? TIMER_EVENT : event ? KEY_EVENT : KEY_SPACE) + strlen(key) + 1) * sizeof(char));
+      if (newkey == NULL) {
+        return luaL_error(L, "subscribe: Out Of Memory");
+      }
+      strcpy(newkey, is_number ? TIMER_EVENT : event ? KEY_EVENT : KEY_SPACE);
+      strcat(newkey, key);
+      lua_pushstring(L, newkey);
+      lua_replace(L, i);
+      free(newkey);
+      if (is_number) {
+        free(buffer);
+      }
+    }
+  }
+  lua_pushstring(L, "subscribe");
+  lua_insert(L, 2);
+
+#ifdef LUA_STACK_CHECK
+  assert(lua_gettop(L) == vtop + 1);
+#endif
+  return lua_client_command(L);
+}
+
+
+/* Template argument of a rule */
+static int check_rule_arg(lua_State *L, int index, rule_arg_t* arg) {
+
+  size_t len;
+  const char* str = lua_tolstring(L, index, &len);
+  if (str == NULL) {
+    return SNAIL_ERR;
+  }
+
+  arg->literal = NULL;
+  if (strcmp(str, "$channel") == 0) {
+    arg->kind = RULE_CHANNEL;
+  } else if (strcmp(str, "$message") == 0) {
+    arg->kind = RULE_MESSAGE;
+  } else if (strcmp(str, "$key") == 0) {
+    arg->kind = RULE_KEY;
+  } else {
+    arg->kind = RULE_LITERAL;
+    arg->literal = sdsnewlen(str, len);
+  }
+  return SNAIL_OK;
+}
+
+
+static int lua_client_rule(lua_State *L) {
+#ifdef LUA_STACK_CHECK
+  int top = lua_gettop(L);
+#endif
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+
+  const char *channel = luaL_checkstring(L, 2);
+  size_t sha_len;
+  const char *sha = luaL_checklstring(L, 3, &sha_len);
+  int nb_keys = lua_istable(L, 4) ? lua_objlen(L, 4) : 0;
+  int nb_args = lua_istable(L, 5) ? lua_objlen(L, 5) : 0;
+
+  if (nb_keys + nb_args > RULE_MAX_ARGS) {
+    return luaL_error(L, "rule: Too many keys and args");
+  }
+  if (cc->durable == NULL && !is_writable(cc)) {
+    return luaL_error(L, "rule: Not connected");
+  }
+
+  /* Check the templates before anything is built */
+  int i;
+  for (i = 0; i < nb_keys + nb_args; i++) {
+    int index = i < nb_keys ? 4 : 5;
+    lua_rawgeti(L, index, i < nb_keys ? i + 1 : i - nb_keys + 1);
+    int type = lua_type(L, -1);
+    lua_pop(L, 1);
+    if (type != LUA_TSTRING && type != LUA_TNUMBER) {
+      return luaL_argerror(L, index, "rule: Not a string or a number");
+    }
+  }
+
+  rule_t* rule = (rule_t*)calloc(1, sizeof(rule_t));
+  if (rule == NULL
+      || (rule->args = calloc(nb_keys + nb_args + 1, sizeof(rule_arg_t))) == NULL) {
+    free(rule);
+    return luaL_error(L, "rule: Out Of Memory");
+  }
+  rule->sha = sdsnewlen(sha, sha_len);
+  rule->nb_keys = nb_keys;
+  rule->nb_args = nb_args;
+  if (lua_isstring(L, 6)) {
+    size_t script_len;
+    const char *script = lua_tolstring(L, 6, &script_len);
+    rule->script = sdsnewlen(script, script_len);
+  }
+  for (i = 0; i < nb_keys + nb_args; i++) {
+    int index = i < nb_keys ? 4 : 5;
+    lua_rawgeti(L, index, i < nb_keys ? i + 1 : i - nb_keys + 1);
+    check_rule_arg(L, -1, &rule->args[i]);
+    lua_pop(L, 1);
+  }
+
+  /* C callback in the subscription tree */
+  bool pattern = (strpbrk(channel, "*?[") != NULL);
+  node_t** tree = pattern ? &cc->patterns : &cc->channels;
+  callback_t *cb = NULL;
+  callback_ll_t* wrapper = NULL;
+  node_t *leaf = NULL;
+  if (create_callback(&cb, LUA_NOREF, 0) != 0
+      || insert(tree, &leaf, channel) != 0
+      || wrap_cb(&wrapper, cb) != 0) {
+    if (leaf != NULL && leaf->cb_list->head == NULL) {
+      delete_node(tree, channel);
+    }
+    if (cb != NULL) {
+      destroy_callback(cb);
+    }
+    destroy_rules(&rule);
+    return luaL_error(L, "rule: Out Of Memory");
+  }
+  cb->flags |= CALLBACK_INITIALIZED;
+  cb->fn = on_rule;
+  cb->data = rule;
+  rule->next = cc->rules;
+  cc->rules = rule;
+
+  /* First callback of the channel */
+  bool subscribe = (leaf->cb_list->head == NULL);
+  push_cb(&leaf->cb_list, wrapper);
+
+  if (subscribe && cc->durable == NULL) {
+    const char *argv[] = {pattern ? "PSUBSCRIBE" : "SUBSCRIBE", channel};
+    int r = 0;
+    if (cc->auto_notify_config) {
+      r = update_notify_config(cc);
+    }
+    if (r == 0) {
+      r = send_command(cc, cc->sub_stream, 2, argv, NULL, NULL);
+    }
+    if (r < 0) {
+      return luaL_error(L, uv_strerror(r));
+    }
+  }
+
+  lua_pushvalue(L, 1);
+#ifdef LUA_STACK_CHECK
+  assert(lua_gettop(L) == top + 1);
+#endif
+  return 1;
+}
 
-        if (argv[argc] == NULL) {
-          return luaL_argerror(L, i, "command: Not a string or a number");
-        }
 
-        if (++argc > LUA_MAX_STACK - 1) {
-          return luaL_error(L, "command: Stack Overflow");
-        }
+static int lua_client_script(lua_State *L) {
+#ifdef LUA_STACK_CHECK
+  int top = lua_gettop(L);
+#endif
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+
+  const char *name = luaL_checkstring(L, 2);
+  size_t source_len;
+  const char *source = luaL_checklstring(L, 3, &source_len);
+
+  script_t* script = find_script(cc, name);
+  if (script == NULL) {
+    script = (script_t*)calloc(1, sizeof(script_t));
+    if (script == NULL) {
+      return luaL_error(L, "script: Out Of Memory");
+    }
+    script->name = sdsnew(name);
+    script->next = cc->scripts;
+    cc->scripts = script;
+  }
+  sdsfree(script->source);
+  sdsfree(script->sha);
+  script->source = sdsnewlen(source, source_len);
+  script->sha = NULL;
+
+  /* Otherwise loaded on connect */
+  if (is_writable(cc)) {
+    int r = load_script(cc, script);
+    if (r < 0) {
+      return luaL_error(L, uv_strerror(r));
+    }
+  }
+
+  lua_pushvalue(L, 1);
+#ifdef LUA_STACK_CHECK
+  assert(lua_gettop(L) == top + 1);
+#endif
+  return 1;
+}
+
+
+static int lua_client_eval(lua_State *L) {
+#ifdef LUA_STACK_CHECK
+  int top = lua_gettop(L);
+#endif
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+
+  const char *name = luaL_checkstring(L, 2);
+  script_t* script = find_script(cc, name);
+  if (script == NULL) {
+    return luaL_argerror(L, 2, "eval: Unknown script");
+  }
+  int nb_keys = lua_istable(L, 3) ? lua_objlen(L, 3) : 0;
+  int nb_args = lua_istable(L, 4) ? lua_objlen(L, 4) : 0;
+  /* A function, a coroutine or a call_all slot, as command */
+  bool callback = has_callback(L);
+
+  if (!is_writable(cc)) {
+    if (callback) {
+      callback_t* cb = NULL;
+      if (create_callback(&cb, luaL_ref(L, LUA_REGISTRYINDEX), 0) != 0) {
+        return luaL_error(L, "eval: Out Of Memory");
       }
+      complete_callback(cc, cb, NULL, "command: Not connected");
+      release_callback(cb);
+      return 0;
+    }
+    return luaL_error(L, "command: Not connected");
+  }
+
+  /* numkeys, keys and args in the protocol format */
+  script_call_t* call = (script_call_t*)malloc(sizeof(script_call_t));
+  if (call == NULL) {
+    return luaL_error(L, "eval: Out Of Memory");
+  }
+  call->script = script;
+  call->argc = nb_keys + nb_args + 1;
+  call->tail = sdscatprintf(sdsempty(), "$%d\r\n%d\r\n",
+                            (nb_keys == 0 ? 1 : (int)(log10(nb_keys) + 1)), nb_keys);
+  int i;
+  for (i = 0; i < nb_keys + nb_args; i++) {
+    size_t len;
+    int index = i < nb_keys ? 3 : 4;
+    lua_rawgeti(L, index, i < nb_keys ? i + 1 : i - nb_keys + 1);
+    const char *arg = lua_tolstring(L, -1, &len);
+    if (arg == NULL) {
+      lua_pop(L, 1);
+      destroy_script_call(call);
+      return luaL_argerror(L, index, "eval: Not a string or a number");
+    }
+    call->tail = sdscatprintf(call->tail, "$%zu\r\n", len);
+    call->tail = sdscatlen(call->tail, arg, len);
+    call->tail = sdscatlen(call->tail, "\r\n", 2);
+    lua_pop(L, 1);
+  }
+
+  /* Arguments checked, nothing leaks on an error above */
+  int ref = callback ? luaL_ref(L, LUA_REGISTRYINDEX) : LUA_REFNIL;
+
+  callback_t* cb = NULL;
+  if (create_callback(&cb, ref, 0) != 0) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    destroy_script_call(call);
+    return luaL_error(L, "eval: Out Of Memory");
+  }
+  cb->fn = on_script_call;
+  cb->data = call;
+
+  /* Not loaded yet, EVAL loads it. On an error cb is already destroyed */
+  int r = send_script_call(cc, call, script->sha != NULL, cb);
+  if (r < 0) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    destroy_script_call(call);
+    return luaL_error(L, uv_strerror(r));
+  }
+
+  lua_pushvalue(L, 1);
+  lua_pushboolean(L, !above_high_water(cc, cc->stream));
+#ifdef LUA_STACK_CHECK
+  /* The callback was popped by luaL_ref */
+  assert(lua_gettop(L) == top + 2 - (callback ? 1 : 0));
+#endif
+  return 2;
+}
+
+
+/* Add an optional option of scan as two arguments */
+static int scan_option(lua_State *L, scan_t* scan, const char* name,
+                       const char* arg) {
+
+  int r = SNAIL_OK;
+  lua_getfield(L, 2, name);
+  if (!lua_isnil(L, -1)) {
+    size_t len;
+    const char* value = lua_tolstring(L, -1, &len);
+    if (value == NULL) {
+      r = SNAIL_ERR;
     } else {
-      size_t key_s;
-      const char * key = lua_tolstring(L, i, &key_s);
-      /* Remove timer key */
-      if (strncmp(key, TIMER_EVENT, strlen(TIMER_EVENT)) != 0) {
-        argv[argc] = key;
-        argvlen[argc] = key_s;
-        if (argv[argc] == NULL) {
-          return luaL_argerror(L, i, "command: Not a string or a number");
-        }
+      scan->argv[scan->argc++] = sdsnew(arg);
+      scan->argv[scan->argc++] = sdsnewlen(value, len);
+    }
+  }
+  lua_pop(L, 1);
+  return r;
+}
 
-        if (++argc > LUA_MAX_STACK - 1) {
-          return luaL_error(L, "command: Stack Overflow");
-        }
-      } else {
-        timers[nb_timers++] = key;
-      }
+
+static int lua_client_scan(lua_State *L) {
+
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  if (!lua_isnoneornil(L, 4)) {
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+  }
+  lua_settop(L, 4);
+
+  if (!is_writable(cc)) {
+    return luaL_error(L, "scan: Not connected");
+  }
+
+  lua_getfield(L, 2, "command");
+  const char* command = lua_isnil(L, -1) ? "scan" : luaL_checkstring(L, -1);
+  lua_getfield(L, 2, "key");
+  const char* key = lua_tostring(L, -1);
+
+  bool keyspace = (strcasecmp(command, "scan") == 0);
+  if (!keyspace && strcasecmp(command, "hscan") != 0
+      && strcasecmp(command, "sscan") != 0
+      && strcasecmp(command, "zscan") != 0) {
+    return luaL_argerror(L, 2, "scan: Unknown command");
+  }
+  if (!keyspace && key == NULL) {
+    return luaL_argerror(L, 2, "scan: No key");
+  }
+
+  scan_t* scan = (scan_t*)calloc(1, sizeof(scan_t));
+  if (scan != NULL) {
+    scan->argv = (sds*)calloc(8, sizeof(sds));
+  }
+  if (scan == NULL || scan->argv == NULL) {
+    free(scan);
+    return luaL_error(L, "scan: Out Of Memory");
+  }
+
+  /* SCAN cursor or HSCAN key cursor, then the options */
+  scan->argv[scan->argc++] = sdsnew(command);
+  if (!keyspace) {
+    scan->argv[scan->argc++] = sdsnew(key);
+  }
+  scan->cursor = scan->argc;
+  scan->argv[scan->argc++] = sdsempty();
+  lua_pop(L, 2);
+  if (scan_option(L, scan, "match", "MATCH") != 0
+      || scan_option(L, scan, "count", "COUNT") != 0
+      || (keyspace && scan_option(L, scan, "type", "TYPE") != 0)) {
+    scan->done = true;
+    release_scan(scan);
+    return luaL_argerror(L, 2, "scan: Not a string or a number");
+  }
+
+  scan->done_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  scan->batch_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  int r = scan_step(cc, scan, "0", 1);
+  if (r < 0) {
+    luaL_unref(L, LUA_REGISTRYINDEX, scan->batch_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, scan->done_ref);
+    scan->done = true;
+    release_scan(scan);
+    return luaL_error(L, uv_strerror(r));
+  }
+
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+
+static int lua_client_bulk(lua_State *L) {
+
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+
+  if (!lua_istable(L, 2) && !lua_isfunction(L, 2)) {
+    return luaL_argerror(L, 2, "bulk: Not an array or an iterator");
+  }
+  int done = lua_isfunction(L, -1) && lua_gettop(L) > 2 ? lua_gettop(L) : 0;
+
+  size_t window = 1000;
+  bool reply_off = false;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "window");
+    if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0) {
+      window = lua_tointeger(L, -1);
     }
+    lua_pop(L, 1);
+    lua_getfield(L, 3, "reply_off");
+    if (lua_isboolean(L, -1)) {
+      reply_off = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
   }
 
-  char *cmd;
-  int len;
-  len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+  if (!is_writable(cc)) {
+    return luaL_error(L, "bulk: Not connected");
+  }
 
-  /* Callback */
+  bulk_t* bulk = (bulk_t*)calloc(1, sizeof(bulk_t));
+  if (bulk == NULL) {
+    return luaL_error(L, "bulk: Out Of Memory");
+  }
+  bulk->iterator = lua_isfunction(L, 2);
+  bulk->window = window;
+  bulk->reply_off = reply_off;
+  bulk->start = uv_hrtime();
+  lua_pushvalue(L, 2);
+  bulk->source_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (done > 0) {
+    lua_pushvalue(L, done);
+    bulk->done_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  } else {
+    bulk->done_ref = LUA_NOREF;
+  }
+
+  /* Keep the order with the batched reads */
+  if (cc->auto_batch) {
+    flush_batches(cc);
+  }
+
+  bulk->running++;
+  bulk_fill(cc, bulk);
+  check_bulk_end(cc, bulk);
+  bulk->running--;
+  release_bulk(bulk);
+
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+
+static int lua_client_replay(lua_State *L) {
+
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+  const char* path = luaL_checkstring(L, 2);
+  int done = lua_isfunction(L, -1) && lua_gettop(L) > 2 ? lua_gettop(L) : 0;
+
+  bool realtime = false;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "realtime");
+    if (lua_isboolean(L, -1)) {
+      realtime = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+
+  if (cc->replay != NULL) {
+    return luaL_error(L, "replay: Already running");
+  }
+
+  replay_t* replay = (replay_t*)calloc(1, sizeof(replay_t));
+  if (replay == NULL) {
+    return luaL_error(L, "replay: Out Of Memory");
+  }
+  replay->done_ref = LUA_NOREF;
+  int r = capture_load(&replay->capture, path);
+  if (r < 0) {
+    free_replay(cc, replay);
+    return luaL_error(L, "replay: %s", uv_strerror(r));
+  }
+  replay->readers[CAPTURE_STREAM] = redisReaderCreate();
+  replay->readers[CAPTURE_SUB_STREAM] = redisReaderCreate();
+  replay->timer = (uv_timer_t*)malloc(sizeof(uv_timer_t));
+  if (replay->readers[CAPTURE_STREAM] == NULL
+      || replay->readers[CAPTURE_SUB_STREAM] == NULL || replay->timer == NULL) {
+    free(replay->timer);
+    replay->timer = NULL;
+    free_replay(cc, replay);
+    return luaL_error(L, "replay: Out Of Memory");
+  }
+
+  /* Get the uv loop */
+  lua_pushstring(L, "uv_loop");
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  uv_loop_t* loop = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  uv_timer_init(loop, replay->timer);
+  replay->timer->data = cc;
+
+  replay->realtime = realtime;
+  replay->start = uv_hrtime();
+  if (done > 0) {
+    lua_pushvalue(L, done);
+    replay->done_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  cc->replay = replay;
+  uv_timer_start(replay->timer, on_replay_timer, 0, 0);
+
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+
+static int lua_client_invalidate(lua_State *L) {
+#ifdef LUA_STACK_CHECK
+  int top = lua_gettop(L);
+#endif
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+
+  luaL_checktype(L, -1, LUA_TFUNCTION);
+  int ltop = lua_gettop(L) - 1;
+  if (ltop < 2) {
+    return luaL_error(L, "invalidate: No key");
+  }
+
+  /* Check the keys before the callback is created */
+  int i;
+  for (i = 2; i <= ltop; i++) {
+    luaL_checkstring(L, i);
+  }
+
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
   callback_t *cb = NULL;
-  int ref = LUA_REFNIL;
-  if (lua_isfunction(L, -1)) {
-    ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (create_callback(&cb, ref, 0) != 0) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    return luaL_error(L, "invalidate: Out Of Memory");
   }
 
-  int pvariant = (tolower(argv[0][0]) == 'p') ? 1 : 0;
-  bool sub_mode = false;
+  /* One callback shared by every key */
+  for (i = 2; i <= ltop; i++) {
+    const char *key = lua_tostring(L, i);
+    node_t *leaf = NULL;
+    callback_ll_t* wrapper = NULL;
+    insert(&cc->invalidations, &leaf, key);
+    if (leaf == NULL || wrap_cb(&wrapper, cb) != 0) {
+      return luaL_error(L, "invalidate: Out Of Memory");
+    }
+    push_cb(&leaf->cb_list, wrapper);
+  }
 
-  if (strncasecmp(argv[0] + pvariant,"subscribe",9) == 0) {
-	  sub_mode = true;
+  lua_pushvalue(L, 1);
+#ifdef LUA_STACK_CHECK
+  assert(lua_gettop(L) == top);
+#endif
+  return 1;
+}
 
-    /* Create callback with channels */
-    if (create_callback(&cb, ref, argc - 1 + nb_timers) == 0) {
-      /* Add every channel/pattern to the list of subscription callbacks. */
-      int k;
-      for (k = 1; k <= argc-1; k++) {
-	      /* Create channel */
-	      channel_t *ch = NULL;
-        if (create_channel(&ch, argv[k]) == 0) {
-          cb->channels[k-1] = ch;
-	      }
-        /* Add to list/tree */
-        node_t *leaf = NULL;
-        if (pvariant) {
-          insert(&(cc->patterns), &leaf, argv[k]);
-        } else {
-          insert(&(cc->channels), &leaf, argv[k]);
-        }
 
-        callback_ll_t* wrapper = NULL;
-        if (wrap_cb(&wrapper, cb) == 0) {
-          push_cb(&(leaf->cb_list), wrapper);
-	      }
-      }
-      for (k = 0; k <= nb_timers -1; k++) {
-        const char *key = timers[k];
-        uint64_t ikey = strtol(key + strlen(TIMER_EVENT), (char **)NULL, 10);
-        /* Create channel */
-	      channel_t *ch = NULL;
-        if (create_timer_channel(&ch, ikey) == 0) {
-          cb->channels[argc - 1 + k] = ch;
-	      }
+/* Reply of a command sent through the FFI, the reply is freed after the call */
+static void on_ffi_reply(void* ctx, callback_t* cb, void* reply, const char* error) {
+
+  client_context_t* cc = (client_context_t*)ctx;
+
+  if (cc->r_reply_cb == LUA_NOREF || cc->r_reply_cb == LUA_REFNIL) {
+    return;
+  }
+
+  lua_State *L = cc->L;
+  const char* name = cb->hist != NULL ? cb->hist->name : "ffi";
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cc->r_reply_cb);
+  lua_pushnumber(L, (uintptr_t)cb->data);
+  if (error != NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, error);
+    timed_pcall(cc, 3, NULL, name);
+  } else {
+    lua_pushlightuserdata(L, reply);
+    timed_pcall(cc, 2, NULL, name);
+  }
+}
+
+
+/* Send a command for the FFI, without the LUA API */
+static int ffi_command(client_context_t* cc, int argc, const char** argv,
+                       const size_t* argvlen, unsigned int id) {
+
+  if (argc <= 0) {
+    return UV_EINVAL;
+  }
+  if (!is_writable(cc)) {
+    return UV_ENOTCONN;
+  }
+
+  /* They go through command */
+  if (changes_reply_flow(argv[0], argvlen[0])) {
+    return UV_EINVAL;
+  }
+
+  /* Keep the order with the batched reads */
+  if (cc->auto_batch) {
+    flush_batches(cc);
+  }
+
+  callback_t* cb = NULL;
+  if (create_callback(&cb, LUA_NOREF, 0) != 0) {
+    return UV_ENOMEM;
+  }
+  cb->fn = on_ffi_reply;
+  cb->data = (void*)(uintptr_t)id;
+  cb->hist = stats_histogram(&cc->stats, argv[0], argvlen[0]);
+  cb->start = uv_hrtime();
+  SNAIL_PROBE3(command, cc, cb, cb->hist ? cb->hist->name : NULL);
+
+  int r = send_command(cc, cc->stream, argc, argv, argvlen, cb);
+  if (r < 0) {
+    return r;
+  }
+  cc->stats.commands++;
+
+  /* Sent, its reply must reach fast.lua even without a deadline */
+  if (cc->timeout > 0) {
+    watch_timeout(cc, cb, cc->timeout);
+  }
+
+  return above_high_water(cc, cc->stream) ? 1 : 0;
+}
+
+
+static const snail_api_t snail_api = {
+  SNAIL_API_VERSION,
+  ffi_command,
+  uv_strerror
+};
+
+
+static int lua_client_ffi(lua_State *L) {
+
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+
+  lua_pushlightuserdata(L, cc);
+  lua_pushlightuserdata(L, (void*)&snail_api);
+  return 2;
+}
+
+/* Push a histogram as {count, min, max, mean, p50, p90, p99, p999, p9999} */
+static void push_histogram(lua_State *L, histogram_t* hist) {
+
+  lua_createtable(L, 0, 9);
+  lua_pushnumber(L, hist->count);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, hist->min);
+  lua_setfield(L, -2, "min");
+  lua_pushnumber(L, hist->max);
+  lua_setfield(L, -2, "max");
+  lua_pushnumber(L, hist->count > 0 ? (double)hist->sum / hist->count : 0);
+  lua_setfield(L, -2, "mean");
+  lua_pushnumber(L, hist_percentile(hist, 50));
+  lua_setfield(L, -2, "p50");
+  lua_pushnumber(L, hist_percentile(hist, 90));
+  lua_setfield(L, -2, "p90");
+  lua_pushnumber(L, hist_percentile(hist, 99));
+  lua_setfield(L, -2, "p99");
+  lua_pushnumber(L, hist_percentile(hist, 99.9));
+  lua_setfield(L, -2, "p999");
+  lua_pushnumber(L, hist_percentile(hist, 99.99));
+  lua_setfield(L, -2, "p9999");
+}
+
+
+static void on_push_latency(node_t* node, void* data) {
+
+  lua_State *L = (lua_State*)data;
+  histogram_t* hist = (histogram_t*)node->data;
+
+  if (hist != NULL && hist->count > 0) {
+    push_histogram(L, hist);
+    lua_setfield(L, -2, node->key);
+  }
+}
+
+
+/* Push {calls, total, mean} of the LUA callbacks of a subscription */
+static void on_push_subscription(node_t* node, void* data) {
+
+  lua_State *L = (lua_State*)data;
+  uint64_t calls = node->calls;
+  uint64_t busy = node->busy;
+
+  if (calls == 0) {
+    return;
+  }
 
-        int status;
-        /* Add to list/tree */
-        node_t *leaf = NULL;
-        if ( (status = insert_timer(&(cc->timers), &leaf, ikey)) >= 1) {
-          if (status != 2) {
-            ch->flags |= CHANNEL_SUBSCRIBED;
-          }
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, calls);
+  lua_setfield(L, -2, "calls");
+  lua_pushnumber(L, busy / 1000);
+  lua_setfield(L, -2, "total");
+  lua_pushnumber(L, (double)busy / 1000 / calls);
+  lua_setfield(L, -2, "mean");
 
-          callback_ll_t* wrapper = NULL;
-          if (wrap_cb(&wrapper, cb) == 0) {
-            push_cb(&(leaf->cb_list), wrapper);
-	        }
-        }
-      }
-    }
-  } else if (strncasecmp(argv[0] + pvariant,"unsubscribe",11) == 0) {
-    sub_mode = true;
-    /* It is only useful to call (P)UNSUBSCRIBE when the context is
-    * subscribed to one or more channels or patterns. */
-    if (!(cc->flags & REDIS_SUBSCRIBED)) {
-      //return REDIS_ERR;
-    }
-    /* (P)UNSUBSCRIBE does not have its own response: every channel or
-     * pattern that is unsubscribed will receive a message. This means we
-    * should not append a callback function for this command. */
+  if (node->key != NULL) {
+    lua_setfield(L, -2, node->key);
   } else {
+    char name[48];
+    snprintf(name, sizeof(name), TIMER_EVENT "%" PRIu64, node->ikey);
+    lua_setfield(L, -2, name);
+  }
+}
 
-    if (strncasecmp(argv[0],"monitor",7) == 0) {
-      /* Set monitor flag and push callback */
-      cc->flags |= REDIS_MONITORING;
-    }
 
-    callback_ll_t* wrapper = NULL;
-    if ( create_callback(&cb, ref, 0) == 0
-      && wrap_cb(&wrapper, cb) == 0 ) {
-      push_cb(&cc->command_cb_list, wrapper);
-    }
+static void on_reset_subscription(node_t* node, void* data) {
+  node->calls = 0;
+  node->busy = 0;
+}
+
+
+/* Monotonic time in ns */
+static int lua_now(lua_State *L) {
+
+  lua_pushnumber(L, (lua_Number)uv_hrtime());
+  return 1;
+}
+
+
+/* Histogram userdata, the recorded values are integers (us for the loadgen) */
+static int lua_histogram_new(lua_State *L) {
+
+  histogram_t* hist = (histogram_t*)lua_newuserdata(L, sizeof(histogram_t));
+  memset(hist, 0, sizeof(histogram_t));
+  luaL_getmetatable(L, LUA_HISTOGRAM_MT);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
+/* record(value, [interval]), with an expected interval the values a stalled
+ * closed-loop client did not send are recorded too (coordinated omission),
+ * at most HIST_BACKFILL of them */
+static int lua_histogram_record(lua_State *L) {
+
+  histogram_t* hist = (histogram_t*)luaL_checkudata(L, 1, LUA_HISTOGRAM_MT);
+  lua_Number value = luaL_checknumber(L, 2);
+  lua_Number interval = luaL_optnumber(L, 3, 0);
+
+  if (!isfinite(value) || value >= 18446744073709551616.0) {
+    return luaL_argerror(L, 2, "histogram: Value out of range");
+  }
+  if (!isfinite(interval) || (interval != 0 && interval < 1)) {
+    return luaL_argerror(L, 3, "histogram: Interval must be >= 1");
   }
 
-  /* Start Writing */
-  int r = 0;
-  uv_write_t* req = NULL;
-  if (cc->flags & REDIS_CONNECTED) {
-    uv_buf_t buf = uv_buf_init(cmd, len);
-    req = (uv_write_t*)req_alloc();
-    req->data = cc;
-    r = uv_write(req, sub_mode ? cc->sub_stream : cc->stream,
-        &buf, 1, on_write);
+  if (value < 0) {
+    value = 0;
   }
-  if (r == 0) {
-    free(cmd);
+  hist_record(hist, (uint64_t)value);
+  if (interval > 0) {
+    lua_Number missing = value - interval;
+    int n;
+    for (n = 0; n < HIST_BACKFILL && missing >= interval; n++) {
+      hist_record(hist, (uint64_t)missing);
+      missing -= interval;
+    }
   }
+  return 0;
+}
 
-  /* Error */
-  if (!(cc->flags & REDIS_CONNECTED)
-    || (cc->flags & (REDIS_DISCONNECTING | REDIS_FREEING))
-    || r < 0) {
 
-   if (req != NULL ) {
-     req_free((uv_req_t*)req);
-   }
+static int lua_histogram_percentile(lua_State *L) {
 
-   const char* error = r < 0 ?
-				  uv_strerror(r)
-				  : "command: Not connected";
+  histogram_t* hist = (histogram_t*)luaL_checkudata(L, 1, LUA_HISTOGRAM_MT);
+  lua_pushnumber(L, hist_percentile(hist, luaL_checknumber(L, 2)));
+  return 1;
+}
 
-    /* Unref and call the callback (if there is) with error */
-    callback_t cb;
-    if(shift_cb(&cc->command_cb_list, &cb) == 0) {
-      if (cb.ref != LUA_NOREF && cb.ref != LUA_REFNIL) {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, cb.ref);
-        luaL_unref(L, LUA_REGISTRYINDEX, cb.ref);
-
-        lua_pushstring(L, error);
-        lua_pcall(L, 1, 0, 0);
-        return 0;
-      }
-    } else if (sub_mode) {
-      // TODO: crash badly
-    }
 
-#ifdef LUA_STACK_CHECK
-    assert(lua_gettop(L) == top - 1);
-#endif
-    /* If no error callback, print stack trace */
-    return luaL_error(L, error);
+static int lua_histogram_merge(lua_State *L) {
+
+  histogram_t* hist = (histogram_t*)luaL_checkudata(L, 1, LUA_HISTOGRAM_MT);
+  histogram_t* other = (histogram_t*)luaL_checkudata(L, 2, LUA_HISTOGRAM_MT);
+  int i;
+
+  if (other->count == 0) {
+    return 0;
   }
-  assert(r == 0);
+  if (hist->count == 0 || other->min < hist->min) {
+    hist->min = other->min;
+  }
+  if (other->max > hist->max) {
+    hist->max = other->max;
+  }
+  hist->count += other->count;
+  hist->sum += other->sum;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    hist->buckets[i] += other->buckets[i];
+  }
+  return 0;
+}
 
-  lua_pushvalue(L, 1);
-#ifdef LUA_STACK_CHECK
-  assert(lua_gettop(L) == top);
-#endif
+
+static int lua_histogram_totable(lua_State *L) {
+
+  histogram_t* hist = (histogram_t*)luaL_checkudata(L, 1, LUA_HISTOGRAM_MT);
+  push_histogram(L, hist);
   return 1;
 }
 
 
-static int lua_client_subscribe(lua_State *L) {
-#ifdef LUA_STACK_CHECK
-  int vtop = lua_gettop(L);
-#endif
-
-  int top = lua_gettop(L);
+static int lua_histogram_reset(lua_State *L) {
 
-  int key_space_prefix_len = strlen(KEY_SPACE);
-  int key_event_prefix_len = strlen(KEY_EVENT);
-  int timer_event_prefix_len = strlen(TIMER_EVENT);
+  histogram_t* hist = (histogram_t*)luaL_checkudata(L, 1, LUA_HISTOGRAM_MT);
+  hist_reset(hist);
+  return 0;
+}
 
-  int i;
-  for (i = 2; i <= top -1; i++) {
-    const char *key;
-    char* buffer;
-    /* Is it a number */
-    bool is_number = false;
-    bool add_prefix = false;
-    if (lua_isnumber (L, i)) {
-      is_number = true;
-      add_prefix = true;
-      int timeout = luaL_checkint(L, i);
-      int len = (timeout == 0 ? 1 : (int)(log10(timeout)+1));
-      buffer = malloc((len + 1) * sizeof(char));
-      snprintf(buffer, len + 1, "%d", timeout);
-      key = buffer;
-    } else {
-      key = luaL_checkstring(L, i);
-      /* Add prefix if needed */
-      add_prefix = !(strncmp(key, KEY_SPACE, key_space_prefix_len) == 0
-              || strncmp(key, KEY_EVENT, key_event_prefix_len) == 0
-              || strncmp(key, TIMER_EVENT, timer_event_prefix_len) == 0);
-    }
 
-    if (add_prefix) {
-      /* Is it an event ? */
-      int j;
-      bool event = false;
-      for (j = 0; j <= NB_EVENTS - 1; j++) {
-	      if (strcmp(events[j], key) == 0) {
-		      event = true;
-		      break;
-	      }
-	    }
+static int lua_client_stats(lua_State *L) {
 
-      char *newkey = malloc((strlen(is_number ? TIMER_EVENT : event ? KEY_EVENT : KEY_SPACE) + strlen(key) + 1) * sizeof(char));
-      if (newkey == NULL) {
-        return luaL_error(L, "subscribe: Out Of Memory");
-      }
-      strcpy(newkey, is_number ? TIMER_EVENT : event ? KEY_EVENT : KEY_SPACE);
-      strcat(newkey, key);
-      lua_pushstring(L, newkey);
-      lua_replace(L, i);
-      free(newkey);
-      if (is_number) {
-        free(buffer);
-      }
-    }
+  client_context_t *cc = (client_context_t*)
+                           luaL_checkudata(L, 1, LUA_CLIENT_MT);
+  bool reset = lua_toboolean(L, 2);
+
+  lua_createtable(L, 0, 8);
+  lua_pushnumber(L, cc->stats.commands);
+  lua_setfield(L, -2, "commands");
+  lua_pushnumber(L, cc->stats.replies);
+  lua_setfield(L, -2, "replies");
+  lua_pushnumber(L, cc->stats.errors);
+  lua_setfield(L, -2, "errors");
+  lua_pushnumber(L, cc->stats.timeouts);
+  lua_setfield(L, -2, "timeouts");
+  lua_pushnumber(L, cc->stats.bytes_in);
+  lua_setfield(L, -2, "bytes_in");
+  lua_pushnumber(L, cc->stats.bytes_out);
+  lua_setfield(L, -2, "bytes_out");
+  lua_pushinteger(L, cc->nb_pending);
+  lua_setfield(L, -2, "pending");
+  lua_newtable(L);
+  walk_tree(cc->stats.latency, on_push_latency, L);
+  lua_setfield(L, -2, "latency");
+  push_histogram(L, &cc->stats.dispatch);
+  lua_setfield(L, -2, "dispatch");
+  if (cc->canary != NULL) {
+    push_histogram(L, &cc->stats.canary);
+    lua_pushnumber(L, cc->stats.canaries);
+    lua_setfield(L, -2, "sent");
+    lua_setfield(L, -2, "canary");
+    push_histogram(L, &cc->stats.canary_read);
+    lua_setfield(L, -2, "canary_read");
   }
-  lua_pushstring(L, "subscribe");
-  lua_insert(L, 2);
-
-#ifdef LUA_STACK_CHECK
-  assert(lua_gettop(L) == vtop + 1);
-#endif
-  return lua_client_command(L);
+  lua_pushnumber(L, cc->stats.slow);
+  lua_setfield(L, -2, "slow");
+  lua_newtable(L);
+  walk_tree(cc->channels, on_push_subscription, L);
+  walk_tree(cc->patterns, on_push_subscription, L);
+  walk_tree(cc->timers, on_push_subscription, L);
+  lua_setfield(L, -2, "subscriptions");
+
+  if (reset) {
+    stats_reset(&cc->stats);
+    walk_tree(cc->channels, on_reset_subscription, NULL);
+    walk_tree(cc->patterns, on_reset_subscription, NULL);
+    walk_tree(cc->timers, on_reset_subscription, NULL);
+  }
+  return 1;
 }
 
 
@@ -855,16 +4664,27 @@ static int lua_client_on(lua_State *L) {
 
   if (lua_isfunction(L, -1)) {
 
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-
+    int* slot = NULL;
     if (strcmp(event_name, "error") == 0) {
-      cc->r_error_cb = ref;
+      slot = &cc->r_error_cb;
     } else if (strcmp(event_name, "connect") == 0) {
-      cc->r_connect_cb = ref;
+      slot = &cc->r_connect_cb;
     } else if (strcmp(event_name, "disconnect") == 0) {
-      cc->r_disconnect_cb = ref;
+      slot = &cc->r_disconnect_cb;
+    } else if (strcmp(event_name, "drain") == 0) {
+      slot = &cc->r_drain_cb;
+    } else if (strcmp(event_name, "reply") == 0) {
+      slot = &cc->r_reply_cb;
+    } else if (strcmp(event_name, "slow") == 0) {
+      slot = &cc->r_slow_cb;
+    }
+
+    if (slot != NULL) {
+      /* Replace the previous listener */
+      luaL_unref(L, LUA_REGISTRYINDEX, *slot);
+      *slot = luaL_ref(L, LUA_REGISTRYINDEX);
     } else {
-      luaL_unref(L, LUA_REGISTRYINDEX, ref);
+      lua_pop(L, 1);
     }
   }
 
@@ -896,24 +4716,34 @@ static int lua_client_connect(lua_State *L) {
   }
   uv_pipe_init(loop, stream, 0);
 
-  uv_pipe_t* sub_stream = (uv_pipe_t*)malloc(sizeof(uv_pipe_t));
-  if (sub_stream == NULL) {
-    return luaL_error(L, "new: Out Of Memory");
+  /* RESP3 doesn't need a dedicated pub/sub connection */
+  uv_pipe_t* sub_stream = stream;
+  if (!cc->resp3) {
+    sub_stream = (uv_pipe_t*)malloc(sizeof(uv_pipe_t));
+    if (sub_stream == NULL) {
+      return luaL_error(L, "new: Out Of Memory");
+    }
+    uv_pipe_init(loop, sub_stream, 0);
   }
-  uv_pipe_init(loop, sub_stream, 0);
 
   cc->stream = (uv_stream_t*)stream;
   cc->sub_stream = (uv_stream_t*)sub_stream;
+  cc->stream->data = cc;
+  cc->sub_stream->data = cc;
   cc->flags = 0;//&= ~REDIS_CONNECTED;
+  cc->stream_flags &= ~CONTEXT_NEED_DRAIN;
+  cc->nb_pending = 0;
 //cc->reader = redisReaderCreate();
 
   uv_connect_t* req = (uv_connect_t*)req_alloc();
   req->data = cc;
   uv_pipe_connect(req, (uv_pipe_t*)cc->stream, cc->path, on_connect);
 
-  uv_connect_t* sub_req = (uv_connect_t*)req_alloc();
-  sub_req->data = cc;
-  uv_pipe_connect(sub_req, (uv_pipe_t*)cc->sub_stream, cc->path, on_connect);
+  if (!cc->resp3) {
+    uv_connect_t* sub_req = (uv_connect_t*)req_alloc();
+    sub_req->data = cc;
+    uv_pipe_connect(sub_req, (uv_pipe_t*)cc->sub_stream, cc->path, on_connect);
+  }
 
 	lua_pop(L,1);
   lua_pushvalue(L, 1);
@@ -930,9 +4760,12 @@ static int lua_client_exit(lua_State *L) {
 #endif
   client_context_t *cc = (client_context_t*)
                            luaL_checkudata(L, 1, LUA_CLIENT_MT);
+  int i;
 
   uv_close((uv_handle_t*)cc->stream, NULL);
-  uv_close((uv_handle_t*)cc->sub_stream, NULL);
+  if (cc->sub_stream != cc->stream) {
+    uv_close((uv_handle_t*)cc->sub_stream, NULL);
+  }
 
   if (cc->r_connect_cb != LUA_NOREF && cc->r_connect_cb != LUA_REFNIL) {
     luaL_unref(cc->L, LUA_REGISTRYINDEX, cc->r_connect_cb);
@@ -943,6 +4776,15 @@ static int lua_client_exit(lua_State *L) {
   if (cc->r_disconnect_cb != LUA_NOREF && cc->r_disconnect_cb != LUA_REFNIL) {
     luaL_unref(cc->L, LUA_REGISTRYINDEX, cc->r_disconnect_cb);
   }
+  if (cc->r_drain_cb != LUA_NOREF && cc->r_drain_cb != LUA_REFNIL) {
+    luaL_unref(cc->L, LUA_REGISTRYINDEX, cc->r_drain_cb);
+  }
+  if (cc->r_reply_cb != LUA_NOREF && cc->r_reply_cb != LUA_REFNIL) {
+    luaL_unref(cc->L, LUA_REGISTRYINDEX, cc->r_reply_cb);
+  }
+  if (cc->r_slow_cb != LUA_NOREF && cc->r_slow_cb != LUA_REFNIL) {
+    luaL_unref(cc->L, LUA_REGISTRYINDEX, cc->r_slow_cb);
+  }
 
   cc->stream_flags &= ~STREAM_CONNECTED;
   cc->stream_flags &= ~SUB_STREAM_CONNECTED;
@@ -950,13 +4792,58 @@ static int lua_client_exit(lua_State *L) {
   destroy_tree(&cc->channels);
   destroy_tree(&cc->patterns);
   destroy_tree(&cc->timers);
+  destroy_tree(&cc->invalidations);
   destroy_list(&cc->command_cb_list);
+  destroy_list(&cc->sub_cb_list);
+  free(cc->sub_cb_list);
+  cc->sub_cb_list = NULL;
+  for (i = 0; i < cc->nb_tracking_prefixes; i++) {
+    free(cc->tracking_prefixes[i]);
+  }
+  free(cc->tracking_prefixes);
+  cc->tracking_prefixes = NULL;
+  cc->nb_tracking_prefixes = 0;
+  destroy_rules(&cc->rules);
+  destroy_scripts(&cc->scripts);
+  if (cc->durable != NULL) {
+    free(cc->durable->stream);
+    free(cc->durable->group);
+    free(cc->durable->consumer);
+    sdsfree(cc->durable->last_id);
+    free(cc->durable);
+    cc->durable = NULL;
+  }
+  destroy_stats(&cc->stats);
+  capture_close(&cc->capture);
+  stop_replay(cc);
+  if (cc->canary != NULL) {
+    if (cc->canary->timer != NULL) {
+      uv_close((uv_handle_t*)cc->canary->timer, on_close_free);
+    }
+    free(cc->canary);
+    cc->canary = NULL;
+  }
+  destroy_wheel(&cc->wheel);
+  if (cc->wheel_timer != NULL) {
+    uv_close((uv_handle_t*)cc->wheel_timer, on_close_free);
+    cc->wheel_timer = NULL;
+  }
+  destroy_tree(&cc->in_flight);
+  discard_batches(cc, NULL);
+  if (cc->batch_check != NULL) {
+    uv_close((uv_handle_t*)cc->batch_check, on_close_free);
+    cc->batch_check = NULL;
+  }
 
+  if (cc->sub_stream != cc->stream) {
+    free(cc->sub_stream);
+  }
   free(cc->stream);
-  free(cc->sub_stream);
   free(cc->path);
   if (cc->reader != NULL)
     redisReaderFree(cc->reader);
+  if (cc->sub_reader != NULL)
+    redisReaderFree(cc->sub_reader);
 
 #ifdef LUA_STACK_CHECK
   assert(lua_gettop(L) == top);
@@ -970,7 +4857,9 @@ static void on_disconnect(uv_handle_t* handle) {
   client_context_t* cc = (client_context_t*)handle->data;
   free(handle);
 
-  if (cc->stream_flags & STREAM_CONNECTED) {
+  if (cc->resp3) {
+    cc->stream_flags &= ~(STREAM_CONNECTED | SUB_STREAM_CONNECTED);
+  } else if (cc->stream_flags & STREAM_CONNECTED) {
     cc->stream_flags &= ~STREAM_CONNECTED;
   } else if (!(cc->stream_flags & STREAM_CONNECTED)
       && (cc->stream_flags & SUB_STREAM_CONNECTED)) {
@@ -983,7 +4872,18 @@ static void on_disconnect(uv_handle_t* handle) {
     destroy_tree(&cc->channels);
     destroy_tree(&cc->patterns);
     destroy_tree(&cc->timers);
-    destroy_list(&cc->command_cb_list);
+    destroy_tree(&cc->invalidations);
+    destroy_list(&cc->sub_cb_list);
+    destroy_rules(&cc->rules);
+    cc->notify_config[0] = '\0';
+    /* Pending commands will never get a reply */
+    discard_batches(cc, "command: Disconnected");
+    fail_command_cbs(cc, "command: Disconnected");
+    destroy_tree(&cc->in_flight);
+    destroy_wheel(&cc->wheel);
+    if (cc->wheel_timer != NULL) {
+      uv_timer_stop(cc->wheel_timer);
+    }
 
     // call disconnect callback
     if (cc->r_disconnect_cb != LUA_NOREF && cc->r_disconnect_cb != LUA_REFNIL) {
@@ -1012,7 +4912,9 @@ static int lua_client_disconnect(lua_State *L) {
     uv_close((uv_handle_t*)cc->stream, on_disconnect);
 
     //uv_read_stop(cc->sub_stream);
-    uv_close((uv_handle_t*)cc->sub_stream, on_disconnect);
+    if (cc->sub_stream != cc->stream) {
+      uv_close((uv_handle_t*)cc->sub_stream, on_disconnect);
+    }
 
     cc->flags |= REDIS_DISCONNECTING;
   }
@@ -1032,6 +4934,24 @@ static int lua_client_new(lua_State *L) {
   client_context_t *cc;
   const char *path;
   bool ignore_sub_cmd_reply = true;
+  uint64_t timeout = 0;
+  size_t high_water_bytes = 0;
+  size_t low_water_bytes = 0;
+  int high_water_cmds = 0;
+  int low_water_cmds = 0;
+  bool auto_batch = false;
+  bool single_flight = false;
+  int lazy_replies = 0;
+  uint64_t slow_callback_ms = 0;
+  uint64_t canary_ms = 0;
+  bool resp3 = false;
+  bool tracking = false;
+  bool auto_notify_config = false;
+  durable_t* durable = NULL;
+  char** tracking_prefixes = NULL;
+  int nb_tracking_prefixes = 0;
+  capture_t* capture = NULL;
+  canary_t* canary = NULL;
 
   // check if table
   luaL_checktype(L, 1, LUA_TTABLE);
@@ -1049,6 +4969,170 @@ static int lua_client_new(lua_State *L) {
     ignore_sub_cmd_reply = lua_toboolean(L, -1);
   }
   lua_pop(L,1);
+  /* Command timeout */
+  lua_pushstring(L, "timeout_ms");
+  lua_gettable(L, -2 );
+  if (lua_isnumber(L, -1)) {
+    double ms = lua_tonumber(L, -1);
+    if (ms < 0 || (ms > 0 && ms < 1)) {
+      return luaL_error(L, "new: timeout_ms must be 0 or >= 1");
+    }
+    timeout = lua_tointeger(L, -1);
+  }
+  lua_pop(L,1);
+  /* LUA callback time for the slow event */
+  lua_pushstring(L, "slow_callback_ms");
+  lua_gettable(L, -2 );
+  if (lua_isnumber(L, -1)) {
+    slow_callback_ms = lua_tointeger(L, -1);
+  }
+  lua_pop(L,1);
+  /* Arrays given as lazy replies from this size */
+  lua_pushstring(L, "lazy_replies");
+  lua_gettable(L, -2 );
+  if (lua_isnumber(L, -1)) {
+    lazy_replies = lua_tointeger(L, -1);
+  }
+  lua_pop(L,1);
+  /* Backpressure, outstanding bytes */
+  lua_pushstring(L, "high_water_mark");
+  lua_gettable(L, -2 );
+  if (lua_isnumber(L, -1)) {
+    high_water_bytes = lua_tointeger(L, -1);
+  }
+  lua_pop(L,1);
+  low_water_bytes = high_water_bytes / 2;
+  lua_pushstring(L, "low_water_mark");
+  lua_gettable(L, -2 );
+  if (lua_isnumber(L, -1)) {
+    low_water_bytes = lua_tointeger(L, -1);
+  }
+  lua_pop(L,1);
+  /* Backpressure, outstanding commands */
+  lua_pushstring(L, "high_water_commands");
+  lua_gettable(L, -2 );
+  if (lua_isnumber(L, -1)) {
+    high_water_cmds = lua_tointeger(L, -1);
+  }
+  lua_pop(L,1);
+  low_water_cmds = high_water_cmds / 2;
+  lua_pushstring(L, "low_water_commands");
+  lua_gettable(L, -2 );
+  if (lua_isnumber(L, -1)) {
+    low_water_cmds = lua_tointeger(L, -1);
+  }
+  lua_pop(L,1);
+  /* Merge GET/HGET into MGET/HMGET */
+  lua_pushstring(L, "auto_batch");
+  lua_gettable(L, -2 );
+  if (lua_isboolean(L, -1)) {
+    auto_batch = lua_toboolean(L, -1);
+  }
+  lua_pop(L,1);
+  /* Share identical reads in flight */
+  lua_pushstring(L, "single_flight");
+  lua_gettable(L, -2 );
+  if (lua_isboolean(L, -1)) {
+    single_flight = lua_toboolean(L, -1);
+  }
+  lua_pop(L,1);
+  /* RESP3 protocol */
+  lua_pushstring(L, "resp3");
+  lua_gettable(L, -2 );
+  if (lua_isboolean(L, -1)) {
+    resp3 = lua_toboolean(L, -1);
+  }
+  lua_pop(L,1);
+  /* Server-assisted invalidation */
+  lua_pushstring(L, "tracking");
+  lua_gettable(L, -2 );
+  if (lua_isboolean(L, -1)) {
+    tracking = lua_toboolean(L, -1);
+  }
+  lua_pop(L,1);
+  /* Minimal notify-keyspace-events */
+  lua_pushstring(L, "auto_notify_config");
+  lua_gettable(L, -2 );
+  if (lua_isboolean(L, -1)) {
+    auto_notify_config = lua_toboolean(L, -1);
+  }
+  lua_pop(L,1);
+  /* Subscriptions fed from a stream consumer group */
+  lua_pushstring(L, "durable");
+  lua_gettable(L, -2 );
+  if (lua_istable(L, -1)) {
+    if (resp3 || tracking) {
+      return luaL_error(L, "new: durable needs a dedicated pub/sub connection");
+    }
+    durable = (durable_t*)malloc(sizeof(durable_t));
+    if (durable == NULL) {
+      return luaL_error(L, "new: Out Of Memory");
+    }
+    lua_getfield(L, -1, "stream");
+    durable->stream = strdup(luaL_checkstring(L, -1));
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "group");
+    durable->group = strdup(lua_isstring(L, -1) ? lua_tostring(L, -1) : "crazysnail");
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "consumer");
+    durable->consumer = strdup(lua_isstring(L, -1) ? lua_tostring(L, -1) : "crazysnail");
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "count");
+    snprintf(durable->count, sizeof(durable->count), "%d",
+             lua_isnumber(L, -1) ? (int)lua_tointeger(L, -1) : 100);
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "block_ms");
+    snprintf(durable->block, sizeof(durable->block), "%d",
+             lua_isnumber(L, -1) ? (int)lua_tointeger(L, -1) : 5000);
+    lua_pop(L, 1);
+    durable->recovering = true;
+    durable->last_id = sdsnew("0");
+  }
+  lua_pop(L,1);
+  /* Broadcasting mode prefixes */
+  lua_pushstring(L, "tracking_prefixes");
+  lua_gettable(L, -2 );
+  if (lua_istable(L, -1)) {
+    int j;
+    int length = lua_objlen(L, -1);
+    tracking_prefixes = malloc(length * sizeof(char*));
+    if (length > 0 && tracking_prefixes == NULL) {
+      return luaL_error(L, "new: Out Of Memory");
+    }
+    for (j = 0; j < length; j++) {
+      lua_rawgeti(L, -1, j + 1);
+      if (lua_isstring(L, -1)) {
+        tracking_prefixes[nb_tracking_prefixes++] = strdup(lua_tostring(L, -1));
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L,1);
+  /* Notification latency canary */
+  lua_pushstring(L, "canary_ms");
+  lua_gettable(L, -2 );
+  if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0) {
+    canary_ms = lua_tointeger(L, -1);
+  }
+  lua_pop(L,1);
+  if (canary_ms > 0) {
+    canary = (canary_t*)calloc(1, sizeof(canary_t));
+    if (canary == NULL) {
+      return luaL_error(L, "new: Out Of Memory");
+    }
+    canary->interval = canary_ms;
+  }
+  /* Capture file, opened last so no error leaks it */
+  lua_pushstring(L, "capture");
+  lua_gettable(L, -2 );
+  if (lua_isstring(L, -1)) {
+    int r = capture_open(&capture, lua_tostring(L, -1));
+    if (r < 0) {
+      free(canary);
+      return luaL_error(L, "new: capture: %s", uv_strerror(r));
+    }
+  }
+  lua_pop(L,1);
 
   /* Initialize Context */
   cc = (client_context_t*)
@@ -1061,15 +5145,58 @@ static int lua_client_new(lua_State *L) {
   cc->r_connect_cb = LUA_NOREF;
   cc->r_disconnect_cb = LUA_NOREF;
   cc->r_error_cb = LUA_NOREF;
+  cc->r_drain_cb = LUA_NOREF;
+  cc->r_reply_cb = LUA_NOREF;
+  cc->r_slow_cb = LUA_NOREF;
+  cc->slow_callback_ns = slow_callback_ms * 1000000;
   cc->flags = 0;
   cc->stream_flags = 0;
+  cc->resp3 = resp3;
   cc->reader = redisReaderCreate();
+  cc->sub_reader = resp3 ? NULL : redisReaderCreate();
   cc->channels = NULL;
   cc->patterns = NULL;
   cc->timers = NULL;
   cc->command_cb_list = (callback_ends_t*)malloc(sizeof(callback_ends_t));
   cc->command_cb_list->head = NULL;
   cc->command_cb_list->tail = NULL;
+  cc->sub_cb_list = (callback_ends_t*)malloc(sizeof(callback_ends_t));
+  cc->sub_cb_list->head = NULL;
+  cc->sub_cb_list->tail = NULL;
+  cc->tracking = tracking;
+  cc->tracking_prefixes = tracking_prefixes;
+  cc->nb_tracking_prefixes = nb_tracking_prefixes;
+  cc->invalidations = NULL;
+  cc->auto_notify_config = auto_notify_config;
+  cc->notify_config[0] = '\0';
+  cc->durable = durable;
+  cc->rules = NULL;
+  cc->scripts = NULL;
+  cc->lazy_replies = lazy_replies;
+  cc->calling = NULL;
+  cc->call_error = NULL;
+  cc->timeout = timeout;
+  cc->wheel = NULL;
+  cc->wheel_timer = NULL;
+  cc->nb_pending = 0;
+  cc->high_water_bytes = high_water_bytes;
+  cc->low_water_bytes = low_water_bytes;
+  cc->high_water_cmds = high_water_cmds;
+  cc->low_water_cmds = low_water_cmds;
+  cc->auto_batch = auto_batch;
+  cc->batches = NULL;
+  cc->batch_check = NULL;
+  cc->single_flight = single_flight;
+  cc->in_flight = NULL;
+  memset(&cc->stats, 0, sizeof(stats_t));
+  cc->capture = capture;
+  cc->replay = NULL;
+  cc->canary = canary;
+  cc->read_time = 0;
+  if (canary != NULL) {
+    snprintf(cc->canary->prefix, sizeof(cc->canary->prefix),
+             CANARY_PREFIX "%d.%" PRIxPTR ":", (int)getpid(), (uintptr_t)cc);
+  }
 
   luaL_getmetatable(L, LUA_CLIENT_MT);
   lua_setmetatable(L, -2);
@@ -1085,6 +5212,8 @@ static int lua_client_new(lua_State *L) {
 
 static const struct luaL_Reg functions[] = {
   {"new", lua_client_new},
+  {"histogram", lua_histogram_new},
+  {"now", lua_now},
   {NULL, NULL}
 };
 
@@ -1096,12 +5225,54 @@ static const struct luaL_Reg methods[] = {
   {"exit", lua_client_exit},
   {"subscribe", lua_client_subscribe},
   {"command", lua_client_command},
+  {"send", lua_client_send},
+  {"call", lua_client_call},
+  {"call_all", lua_client_call_all},
+  {"invalidate", lua_client_invalidate},
+  {"rule", lua_client_rule},
+  {"script", lua_client_script},
+  {"eval", lua_client_eval},
+  {"scan", lua_client_scan},
+  {"bulk", lua_client_bulk},
+  {"replay", lua_client_replay},
+  {"ffi", lua_client_ffi},
+  {"stats", lua_client_stats},
+  {NULL, NULL}
+};
+
+
+static const struct luaL_Reg histogram_methods[] = {
+  {"record", lua_histogram_record},
+  {"percentile", lua_histogram_percentile},
+  {"merge", lua_histogram_merge},
+  {"totable", lua_histogram_totable},
+  {"reset", lua_histogram_reset},
+  {NULL, NULL}
+};
+
+
+static const struct luaL_Reg reply_methods[] = {
+  {"__len", lua_reply_len},
+  {"__index", lua_reply_index},
+  {"__gc", lua_reply_gc},
+  {"ipairs", lua_reply_ipairs},
+  {"totable", lua_reply_totable},
   {NULL, NULL}
 };
 
 
 int luaopen_crazysnail(lua_State *L) {
   //signal(SIGPIPE, SIG_IGN);
+  luaL_newmetatable(L, LUA_JOIN_MT);
+  lua_pop(L, 1);
+  luaL_newmetatable(L, LUA_REPLY_MT);
+  luaL_register(L, NULL, reply_methods);
+  lua_pop(L, 1);
+  luaL_newmetatable(L, LUA_HISTOGRAM_MT);
+  luaL_register(L, NULL, histogram_methods);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
   luaL_newmetatable(L, LUA_CLIENT_MT);
   luaL_register(L, NULL, methods);
   luaL_register(L, NULL, functions);
@@ -30,16 +30,210 @@
 #include "uv.h"
 #include "cb.h"
 #include "hiredis-light.h"
+#include "sds.h"
+#include "stats.h"
+#include "capture.h"
 
 #define SNAIL_ERR -1
 #define SNAIL_OK 0
 
+/* Timeout wheel resolution in ms */
+#define WHEEL_RESOLUTION 10
+
 /* State of stream */
 #define STREAM_CONNECTED 0x1
 #define SUB_STREAM_CONNECTED 0x2
 /* State of context */
 #define CONTEXT_CONNECTED 0x4
+#define CONTEXT_NEED_DRAIN 0x8
+
+
+/* Single key reads merged into one MGET/HMGET */
+typedef struct batch_s {
+  /* Hash for HMGET, NULL for MGET */
+  sds key;
+  /* Command */
+  int argc;
+  int size;
+  sds* argv;
+  /* Callback with a child for each read */
+  callback_t* cb;
+  struct batch_s* next;
+} batch_t;
+
+/* Notifications read from a stream consumer group */
+typedef struct durable_s {
+  char* stream;
+  char* group;
+  char* consumer;
+  char count[24];
+  char block[24];
+  /* Pending entries are read again after a reconnect */
+  bool recovering;
+  /* Last pending entry read */
+  sds last_id;
+} durable_t;
+
+/* Rule template argument */
+#define RULE_LITERAL 0
+#define RULE_CHANNEL 1
+#define RULE_MESSAGE 2
+#define RULE_KEY 3
+
+/* Max keys and args of a rule */
+#define RULE_MAX_ARGS 64
+
+typedef struct rule_arg_s {
+  int kind;
+  sds literal;
+} rule_arg_t;
+
+/* EVALSHA run on a notification */
+typedef struct rule_s {
+  sds sha;
+  /* Source for the NOSCRIPT fallback, NULL if none */
+  sds script;
+  int nb_keys;
+  int nb_args;
+  /* Keys then args */
+  rule_arg_t* args;
+  struct rule_s* next;
+} rule_t;
+
+/* Arguments of a rule EVALSHA (numkeys, keys and args, formatted),
+ * kept for the NOSCRIPT fallback */
+typedef struct rule_call_s {
+  rule_t* rule;
+  int argc;
+  size_t len;
+  char tail[];
+} rule_call_t;
+
+/* Script registered by name */
+typedef struct script_s {
+  sds name;
+  sds source;
+  /* SHA1 from SCRIPT LOAD, NULL until then */
+  sds sha;
+  struct script_s* next;
+} script_t;
+
+/* Several commands awaited by one coroutine */
+typedef struct join_s {
+  int thread_ref;
+  int replies_ref;
+  int errors_ref;
+  int remaining;
+  int nb_errors;
+  /* Yielded, resumed by the last reply */
+  bool waiting;
+} join_t;
 
+/* Callback of one command of a join */
+typedef struct join_slot_s {
+  join_t* join;
+  int index;
+} join_slot_t;
+
+/* Cursor loop of SCAN, HSCAN, SSCAN or ZSCAN */
+typedef struct scan_s {
+  int batch_ref;
+  int done_ref;
+  /* Command, the cursor is at argv[cursor] */
+  int argc;
+  int cursor;
+  sds* argv;
+  /* Elements received */
+  size_t count;
+  /* Next step sent, done callback called, reply being handled */
+  bool in_flight;
+  bool done;
+  int running;
+} scan_t;
+
+/* Mass insertion */
+typedef struct bulk_s {
+  /* Array of commands or iterator */
+  int source_ref;
+  bool iterator;
+  int index;
+  int done_ref;
+  /* Max commands waiting for their reply */
+  size_t window;
+  /* Windows sent between CLIENT REPLY OFF and ON */
+  bool reply_off;
+  size_t windows[2];
+  int nb_windows;
+  size_t sent;
+  size_t in_flight;
+  size_t nb_errors;
+  /* First error reply */
+  sds error;
+  uint64_t start;
+  /* No more commands, done callback called, being filled */
+  bool exhausted;
+  bool done;
+  int running;
+} bulk_t;
+
+/* Replay of a capture through the readers and the subscription callbacks */
+typedef struct replay_s {
+  capture_t* capture;
+  /* One reader by captured stream */
+  redisReader* readers[2];
+  uv_timer_t* timer;
+  int done_ref;
+  /* At the pace of the capture or at full speed */
+  bool realtime;
+  uint64_t start;
+  /* Next record, read before its time */
+  capture_record_t record;
+  bool pending;
+  uint64_t records;
+  uint64_t bytes;
+  uint64_t replies;
+  uint64_t messages;
+  /* In the timer callback, stopped by exit */
+  bool running;
+  bool stopped;
+} replay_t;
+
+/* Notification latency canary, a key written with its time */
+typedef struct canary_s {
+  uint64_t interval;
+  /* Key prefix of the client, "__crazysnail_canary__:<pid>.<id>:" */
+  char prefix[64];
+  uv_timer_t* timer;
+} canary_t;
+
+/* Aggregate reply detached from the reader, shared by its lazy replies */
+typedef struct lazy_root_s {
+  redisReply* reply;
+  int refs;
+} lazy_root_t;
+
+/* Lazy reply userdata, an array or a set of the root */
+typedef struct lazy_reply_s {
+  lazy_root_t* root;
+  redisReply* reply;
+  /* Nested arrays from this size are lazy too */
+  int threshold;
+} lazy_reply_t;
+
+/* Context for a connection to Redis */
+struct client_context_s;
+
+/* C ABI for the LuaJIT FFI, keep in sync with the cdef of fast.lua */
+#define SNAIL_API_VERSION 1
+
+typedef struct snail_api_s {
+  int version;
+  /* Send a command, its reply goes to the reply event with id.
+   * 0 if sent, 1 if sent above a high-water mark, a UV error otherwise */
+  int (*command)(struct client_context_s* cc, int argc, const char** argv,
+                 const size_t* argvlen, unsigned int id);
+  const char* (*strerror)(int err);
+} snail_api_t;
 
 /* Context for a connection to Redis */
 typedef struct client_context_s {
@@ -58,19 +252,81 @@ typedef struct client_context_s {
   int r_error_cb;
   /* Disconnect Callback */
   int r_disconnect_cb;
+  /* Drain Callback */
+  int r_drain_cb;
+  /* FFI Reply Callback */
+  int r_reply_cb;
+  /* Slow Callback */
+  int r_slow_cb;
+  /* LUA callback time for the slow event (ns), 0 for none */
+  uint64_t slow_callback_ns;
   /* List of Command Callback */
   callback_ends_t* command_cb_list;
+  /* Internal commands of the pub/sub stream (RESP2) */
+  callback_ends_t* sub_cb_list;
+  /* Number of Command Callback */
+  int nb_pending;
+  /* Backpressure high and low-water marks, 0 for none */
+  size_t high_water_bytes;
+  size_t low_water_bytes;
+  int high_water_cmds;
+  int low_water_cmds;
+  /* Reads batched until the end of the loop iteration */
+  bool auto_batch;
+  batch_t* batches;
+  uv_check_t* batch_check;
+  /* Reads in flight shared with identical ones */
+  bool single_flight;
+  node_t *in_flight;
+  /* Default command timeout in ms, 0 for none */
+  uint64_t timeout;
+  /* Command deadlines */
+  wheel_t* wheel;
+  uv_timer_t* wheel_timer;
 
   /* Tree of Subscription Callback */
   node_t *channels;
   node_t *patterns;
   node_t *timers;
+  /* Server-assisted invalidation, callbacks by key */
+  bool tracking;
+  char** tracking_prefixes;
+  int nb_tracking_prefixes;
+  node_t *invalidations;
+  /* Minimal notify-keyspace-events, last one applied
+   * ("+KEA" style, empty if unknown) */
+  bool auto_notify_config;
+  char notify_config[16];
+  /* Notification rules */
+  rule_t* rules;
+  /* Scripts loaded on connect */
+  script_t* scripts;
+  /* Arrays from this size are given as lazy replies, 0 for none */
+  int lazy_replies;
+  /* Coroutine in snail:call, not yielded yet */
+  lua_State* calling;
+  const char* call_error;
+  /* Subscriptions fed from a stream, NULL for pub/sub */
+  durable_t* durable;
+
+  /* Counters and latency histograms */
+  stats_t stats;
+  /* Bytes read and written, NULL for none */
+  capture_t* capture;
+  replay_t* replay;
+  /* Notification latency canary, NULL for none */
+  canary_t* canary;
+  /* Time of the last read */
+  uint64_t read_time;
 
   /* Flags */
   int flags;
   int stream_flags;
+  /* RESP3, replies and push notifications share the stream */
+  bool resp3;
   /* Redis Protocol Reader */
   redisReader *reader;
+  redisReader *sub_reader;
 } client_context_t;
 
 /* Request allocator */
@@ -31,7 +31,9 @@
 
 //#include "fmacros.h"
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <math.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
@@ -40,11 +42,17 @@
 #include "hiredis-light.h"
 #include "sds.h"
 
+/* Task type of a RESP3 blob error ('!') while it is read,
+ * the reply is created with REDIS_REPLY_ERROR */
+#define REDIS_READ_BLOB_ERROR 100
+
 static redisReply *createReplyObject(int type);
 static void *createStringObject(const redisReadTask *task, char *str, size_t len);
 static void *createArrayObject(const redisReadTask *task, int elements);
 static void *createIntegerObject(const redisReadTask *task, long long value);
+static void *createDoubleObject(const redisReadTask *task, double value, char *str, size_t len);
 static void *createNilObject(const redisReadTask *task);
+static void *createBoolObject(const redisReadTask *task, int bval);
 
 /* Default set of functions to build the reply. Keep in mind that such a
  * function returning NULL is interpreted as OOM. */
@@ -52,10 +60,18 @@ static redisReplyObjectFunctions defaultFunctions = {
     createStringObject,
     createArrayObject,
     createIntegerObject,
+    createDoubleObject,
     createNilObject,
+    createBoolObject,
     freeReplyObject
 };
 
+/* Is it an aggregate type holding elements? */
+static int isAggregateType(int type) {
+    return type == REDIS_REPLY_ARRAY || type == REDIS_REPLY_MAP ||
+           type == REDIS_REPLY_SET || type == REDIS_REPLY_PUSH;
+}
+
 /* Create a reply object */
 static redisReply *createReplyObject(int type) {
     redisReply *r = calloc(1,sizeof(*r));
@@ -74,8 +90,13 @@ void freeReplyObject(void *reply) {
 
     switch(r->type) {
     case REDIS_REPLY_INTEGER:
+    case REDIS_REPLY_NIL:
+    case REDIS_REPLY_BOOL:
         break; /* Nothing to free */
     case REDIS_REPLY_ARRAY:
+    case REDIS_REPLY_MAP:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_PUSH:
         if (r->element != NULL) {
             for (j = 0; j < r->elements; j++)
                 if (r->element[j] != NULL)
@@ -86,6 +107,9 @@ void freeReplyObject(void *reply) {
     case REDIS_REPLY_ERROR:
     case REDIS_REPLY_STATUS:
     case REDIS_REPLY_STRING:
+    case REDIS_REPLY_DOUBLE:
+    case REDIS_REPLY_VERB:
+    case REDIS_REPLY_BIGNUM:
         if (r->str != NULL)
             free(r->str);
         break;
@@ -109,9 +133,18 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 
     assert(task->type == REDIS_REPLY_ERROR  ||
            task->type == REDIS_REPLY_STATUS ||
-           task->type == REDIS_REPLY_STRING);
+           task->type == REDIS_REPLY_STRING ||
+           task->type == REDIS_REPLY_VERB   ||
+           task->type == REDIS_REPLY_BIGNUM);
 
     /* Copy string value */
+    if (task->type == REDIS_REPLY_VERB) {
+        /* Content type prefix "txt:" is stored aside */
+        memcpy(r->vtype,str,3);
+        r->vtype[3] = '\0';
+        str += 4;
+        len -= 4;
+    }
     memcpy(buf,str,len);
     buf[len] = '\0';
     r->str = buf;
@@ -119,7 +152,7 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -128,7 +161,7 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 static void *createArrayObject(const redisReadTask *task, int elements) {
     redisReply *r, *parent;
 
-    r = createReplyObject(REDIS_REPLY_ARRAY);
+    r = createReplyObject(task->type);
     if (r == NULL)
         return NULL;
 
@@ -144,7 +177,7 @@ static void *createArrayObject(const redisReadTask *task, int elements) {
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -161,7 +194,50 @@ static void *createIntegerObject(const redisReadTask *task, long long value) {
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(isAggregateType(parent->type));
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createDoubleObject(const redisReadTask *task, double value, char *str, size_t len) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(REDIS_REPLY_DOUBLE);
+    if (r == NULL)
+        return NULL;
+
+    r->dval = value;
+    /* Keep the string representation, it can't be rebuilt exactly */
+    r->str = malloc(len+1);
+    if (r->str == NULL) {
+        freeReplyObject(r);
+        return NULL;
+    }
+    memcpy(r->str,str,len);
+    r->str[len] = '\0';
+    r->len = len;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(isAggregateType(parent->type));
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createBoolObject(const redisReadTask *task, int bval) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(REDIS_REPLY_BOOL);
+    if (r == NULL)
+        return NULL;
+
+    r->integer = bval != 0;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -176,7 +252,7 @@ static void *createNilObject(const redisReadTask *task) {
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(isAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -337,7 +413,7 @@ static void moveToNextTask(redisReader *r) {
 
         cur = &(r->rstack[r->ridx]);
         prv = &(r->rstack[r->ridx-1]);
-        assert(prv->type == REDIS_REPLY_ARRAY);
+        assert(isAggregateType(prv->type));
         if (cur->idx == prv->elements-1) {
             r->ridx--;
         } else {
@@ -363,6 +439,53 @@ static int processLineItem(redisReader *r) {
                 obj = r->fn->createInteger(cur,readLongLong(p));
             else
                 obj = (void*)REDIS_REPLY_INTEGER;
+        } else if (cur->type == REDIS_REPLY_DOUBLE) {
+            char buf[326], *eptr;
+            double d;
+
+            if ((size_t)len >= sizeof(buf)) {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                        "Double value is too large");
+                return REDIS_ERR;
+            }
+            memcpy(buf,p,len);
+            buf[len] = '\0';
+
+            if (strcasecmp(buf,"inf") == 0) {
+                d = INFINITY;
+            } else if (strcasecmp(buf,"-inf") == 0) {
+                d = -INFINITY;
+            } else if (strcasecmp(buf,"nan") == 0) {
+                d = NAN;
+            } else {
+                d = strtod(buf,&eptr);
+                if (buf[0] == '\0' || eptr[0] != '\0') {
+                    __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                            "Bad double value");
+                    return REDIS_ERR;
+                }
+            }
+            if (r->fn && r->fn->createDouble)
+                obj = r->fn->createDouble(cur,d,buf,len);
+            else
+                obj = (void*)REDIS_REPLY_DOUBLE;
+        } else if (cur->type == REDIS_REPLY_NIL) {
+            if (r->fn && r->fn->createNil)
+                obj = r->fn->createNil(cur);
+            else
+                obj = (void*)REDIS_REPLY_NIL;
+        } else if (cur->type == REDIS_REPLY_BOOL) {
+            int bval = (len == 1) ? tolower(p[0]) : 0;
+
+            if (bval != 't' && bval != 'f') {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                        "Bad bool value");
+                return REDIS_ERR;
+            }
+            if (r->fn && r->fn->createBool)
+                obj = r->fn->createBool(cur,bval == 't');
+            else
+                obj = (void*)REDIS_REPLY_BOOL;
         } else {
             /* Type will be error or status. */
             if (r->fn && r->fn->createString)
@@ -411,6 +534,15 @@ static int processBulkItem(redisReader *r) {
             /* Only continue when the buffer contains the entire bulk item. */
             bytelen += len+2; /* include \r\n */
             if (r->pos+bytelen <= r->len) {
+                if (cur->type == REDIS_REPLY_VERB
+                    && (len < 4 || s[2+3] != ':')) {
+                    __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                            "Verbatim string 4 bytes of content type are "
+                            "missing or incorrectly encoded.");
+                    return REDIS_ERR;
+                }
+                if (cur->type == REDIS_READ_BLOB_ERROR)
+                    cur->type = REDIS_REPLY_ERROR;
                 if (r->fn && r->fn->createString)
                     obj = r->fn->createString(cur,s+2,len);
                 else
@@ -438,7 +570,7 @@ static int processBulkItem(redisReader *r) {
     return REDIS_ERR;
 }
 
-static int processMultiBulkItem(redisReader *r) {
+static int processAggregateItem(redisReader *r) {
     redisReadTask *cur = &(r->rstack[r->ridx]);
     void *obj;
     char *p;
@@ -456,6 +588,10 @@ static int processMultiBulkItem(redisReader *r) {
         elements = readLongLong(p);
         root = (r->ridx == 0);
 
+        /* A map holds a key and a value for each element */
+        if (cur->type == REDIS_REPLY_MAP && elements > 0)
+            elements *= 2;
+
         if (elements == -1) {
             if (r->fn && r->fn->createNil)
                 obj = r->fn->createNil(cur);
@@ -526,6 +662,33 @@ static int processItem(redisReader *r) {
             case '*':
                 cur->type = REDIS_REPLY_ARRAY;
                 break;
+            case '%':
+                cur->type = REDIS_REPLY_MAP;
+                break;
+            case '~':
+                cur->type = REDIS_REPLY_SET;
+                break;
+            case '>':
+                cur->type = REDIS_REPLY_PUSH;
+                break;
+            case ',':
+                cur->type = REDIS_REPLY_DOUBLE;
+                break;
+            case '_':
+                cur->type = REDIS_REPLY_NIL;
+                break;
+            case '#':
+                cur->type = REDIS_REPLY_BOOL;
+                break;
+            case '(':
+                cur->type = REDIS_REPLY_BIGNUM;
+                break;
+            case '=':
+                cur->type = REDIS_REPLY_VERB;
+                break;
+            case '!':
+                cur->type = REDIS_READ_BLOB_ERROR;
+                break;
             default:
                 __redisReaderSetErrorProtocolByte(r,*p);
                 return REDIS_ERR;
@@ -538,14 +701,24 @@ static int processItem(redisReader *r) {
 
     /* process typed item */
     switch(cur->type) {
+    case REDIS_READ_BLOB_ERROR:
+        return processBulkItem(r);
     case REDIS_REPLY_ERROR:
     case REDIS_REPLY_STATUS:
     case REDIS_REPLY_INTEGER:
+    case REDIS_REPLY_DOUBLE:
+    case REDIS_REPLY_NIL:
+    case REDIS_REPLY_BOOL:
+    case REDIS_REPLY_BIGNUM:
         return processLineItem(r);
     case REDIS_REPLY_STRING:
+    case REDIS_REPLY_VERB:
         return processBulkItem(r);
     case REDIS_REPLY_ARRAY:
-        return processMultiBulkItem(r);
+    case REDIS_REPLY_MAP:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_PUSH:
+        return processAggregateItem(r);
     default:
         assert(NULL);
         return REDIS_ERR; /* Avoid warning. */
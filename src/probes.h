@@ -0,0 +1,56 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 gsick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __PROBES_H
+#define __PROBES_H
+
+/* USDT probes of the provider crazysnail, built with `make USDT=1`
+ * (needs sys/sdt.h, systemtap-sdt-dev). A probe is a nop until a tracer
+ * attaches to it, without USDT the macros are empty.
+ *
+ *   connect(cc, stream, status)        on_connect
+ *   write(cc, stream, len)             uv_write submission
+ *   write_done(cc, stream, status)     on_write
+ *   read(cc, stream, nread)            on_read
+ *   command(cc, cb, name)              command sent, cb is the reply key
+ *   reply(cc, cb, type, latency_ns)    command reply parsed, cb may be NULL
+ *   message(cc, channel, type)         pub/sub message parsed
+ *   dispatch(cc, name, elapsed_ns)     LUA callback done
+ *
+ * See tools/bpftrace for examples. */
+
+#ifdef SNAIL_USDT
+
+#include <sys/sdt.h>
+
+#define SNAIL_PROBE3(name, a, b, c) DTRACE_PROBE3(crazysnail, name, a, b, c)
+#define SNAIL_PROBE4(name, a, b, c, d) DTRACE_PROBE4(crazysnail, name, a, b, c, d)
+
+#else
+
+#define SNAIL_PROBE3(name, a, b, c) do {} while (0)
+#define SNAIL_PROBE4(name, a, b, c, d) do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 gsick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+#include "crazysnail.h"
+
+/* Longest command name kept, longer ones share a histogram */
+#define STATS_NAME_MAX 31
+
+
+static int hist_index(uint64_t value) {
+
+  if (value < HIST_SUB) {
+    return (int)value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  int sub = (int)(value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB - 1);
+  return (exponent - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+
+/* Highest value of a bucket */
+static uint64_t hist_value(int index) {
+
+  if (index < HIST_SUB) {
+    return index;
+  }
+  int exponent = index / HIST_SUB + HIST_SUB_BITS - 1;
+  uint64_t sub = index % HIST_SUB;
+  uint64_t low = (HIST_SUB + sub) << (exponent - HIST_SUB_BITS);
+  return low + ((uint64_t)1 << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+
+void hist_record(histogram_t* hist, uint64_t value) {
+  assert(hist != NULL);
+
+  if (hist->count == 0 || value < hist->min) {
+    hist->min = value;
+  }
+  if (value > hist->max) {
+    hist->max = value;
+  }
+  hist->count++;
+  hist->sum += value;
+  hist->buckets[hist_index(value)]++;
+}
+
+
+uint64_t hist_percentile(const histogram_t* hist, double percentile) {
+  assert(hist != NULL);
+
+  if (hist->count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank) {
+      uint64_t value = hist_value(i);
+      return value < hist->max ? value : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+
+void hist_reset(histogram_t* hist) {
+  assert(hist != NULL);
+  const char* name = hist->name;
+  memset(hist, 0, sizeof(histogram_t));
+  hist->name = name;
+}
+
+
+/* Histogram of a command, created on first use, NULL if out of memory */
+histogram_t* stats_histogram(stats_t* stats, const char* name, size_t len) {
+  assert(stats != NULL);
+
+  char key[STATS_NAME_MAX + 1];
+  size_t i;
+  if (len > STATS_NAME_MAX) {
+    len = STATS_NAME_MAX;
+  }
+  for (i = 0; i < len; i++) {
+    key[i] = tolower((unsigned char)name[i]);
+  }
+  key[len] = '\0';
+
+  node_t* leaf = NULL;
+  if (insert(&stats->latency, &leaf, key) != 0 || leaf == NULL) {
+    return NULL;
+  }
+  if (leaf->data == NULL) {
+    histogram_t* hist = (histogram_t*)calloc(1, sizeof(histogram_t));
+    if (hist != NULL) {
+      hist->name = leaf->key;
+    }
+    leaf->data = hist;
+  }
+  return (histogram_t*)leaf->data;
+}
+
+
+static void reset_histogram(node_t* node, void* data) {
+  if (node->data != NULL) {
+    hist_reset((histogram_t*)node->data);
+  }
+}
+
+
+void stats_reset(stats_t* stats) {
+  assert(stats != NULL);
+
+  stats->commands = 0;
+  stats->replies = 0;
+  stats->errors = 0;
+  stats->timeouts = 0;
+  stats->bytes_in = 0;
+  stats->bytes_out = 0;
+  stats->slow = 0;
+  hist_reset(&stats->dispatch);
+  stats->canaries = 0;
+  hist_reset(&stats->canary);
+  hist_reset(&stats->canary_read);
+  /* Histograms are kept, callbacks in flight refer to them */
+  walk_tree(stats->latency, reset_histogram, NULL);
+}
+
+
+static void free_histogram(node_t* node, void* data) {
+  free(node->data);
+  node->data = NULL;
+}
+
+
+void destroy_stats(stats_t* stats) {
+  assert(stats != NULL);
+
+  walk_tree(stats->latency, free_histogram, NULL);
+  destroy_tree(&stats->latency);
+}
@@ -0,0 +1,73 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 gsick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+#include "cb.h"
+
+/* Log-linear histogram: 2^HIST_SUB_BITS linear buckets per power of two,
+ * the relative error is below 1 / 2^HIST_SUB_BITS */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct histogram_s {
+  /* Command name, NULL if none */
+  const char* name;
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+  uint32_t buckets[HIST_BUCKETS];
+} histogram_t;
+
+/* Counters of a context */
+typedef struct stats_s {
+  uint64_t commands;
+  uint64_t replies;
+  uint64_t errors;
+  uint64_t timeouts;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  /* Latency histogram (us) by command name */
+  node_t* latency;
+  /* Time of the LUA callbacks (us) and the slow ones */
+  histogram_t dispatch;
+  uint64_t slow;
+  /* Canary keys written, delay (us) to their notification and to its read */
+  uint64_t canaries;
+  histogram_t canary;
+  histogram_t canary_read;
+} stats_t;
+
+void hist_record(histogram_t* hist, uint64_t value);
+uint64_t hist_percentile(const histogram_t* hist, double percentile);
+void hist_reset(histogram_t* hist);
+
+histogram_t* stats_histogram(stats_t* stats, const char* name, size_t len);
+void stats_reset(stats_t* stats);
+void destroy_stats(stats_t* stats);
+
+#endif
@@ -0,0 +1,687 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 gsick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * RESP mock server on a Unix Domain Socket, for the tests and the benchmarks
+ * without a Redis instance. Single thread, poll().
+ *
+ *   mock-redis [-s path] [-r replies] [-l latency_ms] [-j jitter_ms]
+ *              [-f fragment_bytes] [-g fragment_gap_ms]
+ *              [-n notifications_per_s] [-k keys] [-e event] [-d drop_after]
+ *
+ * Replies file: one "COMMAND reply" per line, the reply in RESP with
+ * \r \n \t \\ escapes, '#' for comments. It overrides the built-in commands:
+ * PING, HELLO, SUBSCRIBE, PSUBSCRIBE, UNSUBSCRIBE, PUNSUBSCRIBE, PUBLISH,
+ * SET (key-space notification), GET ($-1), CLIENT ID, QUIT and MOCK.
+ * Any other command gets +OK.
+ *
+ * MOCK DROP closes the other connections, MOCK RATE n sets the notification
+ * rate, SIGUSR1 closes all the connections.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MOCK_MAX_CONNS 1024
+#define MOCK_MAX_ARGS 64
+#define MOCK_MAX_SUBS 64
+#define MOCK_MAX_REPLIES 256
+/* Notifications sent per loop iteration, the rest is late */
+#define MOCK_MAX_BURST 10000
+
+/* Reply waiting for its time */
+typedef struct chunk_s {
+  uint64_t due;
+  size_t len;
+  size_t off;
+  struct chunk_s* next;
+  char data[];
+} chunk_t;
+
+typedef struct conn_s {
+  int fd;
+  int id;
+  bool resp3;
+  uint64_t commands;
+  char* in;
+  size_t in_len;
+  size_t in_size;
+  chunk_t* head;
+  chunk_t* tail;
+  char* subs[MOCK_MAX_SUBS];
+  int nb_subs;
+  char* psubs[MOCK_MAX_SUBS];
+  int nb_psubs;
+  bool closing;
+} conn_t;
+
+typedef struct reply_s {
+  char name[32];
+  char* data;
+  size_t len;
+} reply_t;
+
+typedef struct options_s {
+  const char* path;
+  uint64_t latency;
+  uint64_t jitter;
+  size_t fragment;
+  uint64_t fragment_gap;
+  double rate;
+  int keys;
+  const char* event;
+  uint64_t drop_after;
+} options_t;
+
+static options_t options = {"/tmp/crazysnail-mock.sock", 0, 0, 0, 0, 0, 1000,
+                            "set", 0};
+static conn_t* conns[MOCK_MAX_CONNS];
+static int nb_conns = 0;
+static int next_id = 1;
+static reply_t replies[MOCK_MAX_REPLIES];
+static int nb_replies = 0;
+static volatile sig_atomic_t drop_all = 0;
+static uint64_t notify_start = 0;
+static uint64_t notified = 0;
+
+
+/* Monotonic time in us */
+static uint64_t now_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void on_usr1(int sig) {
+  drop_all = 1;
+}
+
+
+/* Queue data for the time of the reply, split in fragments if asked */
+static void queue_data(conn_t* c, const char* data, size_t len, uint64_t due) {
+
+  size_t frag = options.fragment > 0 ? options.fragment : len;
+  size_t off = 0;
+
+  if (c->tail != NULL && c->tail->due > due) {
+    /* Keep the order */
+    due = c->tail->due;
+  }
+  while (off < len) {
+    size_t n = len - off < frag ? len - off : frag;
+    chunk_t* chunk = (chunk_t*)malloc(sizeof(chunk_t) + n);
+    if (chunk == NULL) {
+      c->closing = true;
+      return;
+    }
+    memcpy(chunk->data, data + off, n);
+    chunk->len = n;
+    chunk->off = 0;
+    chunk->due = due;
+    chunk->next = NULL;
+    if (c->tail != NULL) {
+      c->tail->next = chunk;
+    } else {
+      c->head = chunk;
+    }
+    c->tail = chunk;
+    off += n;
+    due += options.fragment_gap;
+  }
+}
+
+
+/* Reply after the latency and its jitter */
+static void reply(conn_t* c, const char* data, size_t len) {
+
+  uint64_t delay = options.latency;
+  if (options.jitter > 0) {
+    delay += (uint64_t)rand() % (options.jitter + 1);
+  }
+  queue_data(c, data, len, now_us() + delay);
+}
+
+
+static void reply_str(conn_t* c, const char* str) {
+  reply(c, str, strlen(str));
+}
+
+
+/* Array or push of bulk strings, an integer as last element if count >= 0 */
+static void reply_push(conn_t* c, int argc, const char** argv, long count,
+                       bool now) {
+
+  char buf[4096];
+  int n = snprintf(buf, sizeof(buf), "%c%d\r\n", c->resp3 ? '>' : '*',
+                   argc + (count >= 0 ? 1 : 0));
+  int i;
+  for (i = 0; i < argc && n < (int)sizeof(buf); i++) {
+    n += snprintf(buf + n, sizeof(buf) - n, "$%zu\r\n%s\r\n",
+                  strlen(argv[i]), argv[i]);
+  }
+  if (count >= 0 && n < (int)sizeof(buf)) {
+    n += snprintf(buf + n, sizeof(buf) - n, ":%ld\r\n", count);
+  }
+  if (n >= (int)sizeof(buf)) {
+    return;
+  }
+  if (now) {
+    queue_data(c, buf, n, now_us());
+  } else {
+    reply(c, buf, n);
+  }
+}
+
+
+/* Send a message to the subscribers of the channel, the number of them */
+static int publish(const char* channel, const char* message) {
+
+  int i, j, n = 0;
+  for (i = 0; i < nb_conns; i++) {
+    conn_t* c = conns[i];
+    for (j = 0; j < c->nb_subs; j++) {
+      if (strcmp(c->subs[j], channel) == 0) {
+        const char* argv[] = {"message", channel, message};
+        reply_push(c, 3, argv, -1, true);
+        n++;
+      }
+    }
+    for (j = 0; j < c->nb_psubs; j++) {
+      if (fnmatch(c->psubs[j], channel, 0) == 0) {
+        const char* argv[] = {"pmessage", c->psubs[j], channel, message};
+        reply_push(c, 4, argv, -1, true);
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+
+/* Key-space and key-event notifications of a key */
+static void notify(const char* key, const char* event) {
+
+  char channel[512];
+  snprintf(channel, sizeof(channel), "__keyspace@0__:%s", key);
+  publish(channel, event);
+  snprintf(channel, sizeof(channel), "__keyevent@0__:%s", event);
+  publish(channel, key);
+}
+
+
+static void subscribe(conn_t* c, int argc, char** argv, bool pattern) {
+
+  char** subs = pattern ? c->psubs : c->subs;
+  int* nb = pattern ? &c->nb_psubs : &c->nb_subs;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (*nb < MOCK_MAX_SUBS) {
+      subs[(*nb)++] = strdup(argv[i]);
+    }
+    const char* ack[] = {pattern ? "psubscribe" : "subscribe", argv[i]};
+    reply_push(c, 2, ack, c->nb_subs + c->nb_psubs, false);
+  }
+}
+
+
+static void unsubscribe(conn_t* c, int argc, char** argv, bool pattern) {
+
+  char** subs = pattern ? c->psubs : c->subs;
+  int* nb = pattern ? &c->nb_psubs : &c->nb_subs;
+  int i, j;
+  for (i = 1; i < argc; i++) {
+    for (j = 0; j < *nb; j++) {
+      if (strcmp(subs[j], argv[i]) == 0) {
+        free(subs[j]);
+        subs[j] = subs[--(*nb)];
+        break;
+      }
+    }
+    const char* ack[] = {pattern ? "punsubscribe" : "unsubscribe", argv[i]};
+    reply_push(c, 2, ack, c->nb_subs + c->nb_psubs, false);
+  }
+}
+
+
+static reply_t* find_reply(const char* name) {
+
+  int i;
+  for (i = 0; i < nb_replies; i++) {
+    if (strcmp(replies[i].name, name) == 0) {
+      return &replies[i];
+    }
+  }
+  return NULL;
+}
+
+
+static void command(conn_t* c, int argc, char** argv) {
+
+  char name[32];
+  char buf[256];
+  size_t i;
+
+  for (i = 0; i < sizeof(name) - 1 && argv[0][i] != '\0'; i++) {
+    name[i] = toupper((unsigned char)argv[0][i]);
+  }
+  name[i] = '\0';
+  c->commands++;
+
+  reply_t* r = find_reply(name);
+  if (r != NULL) {
+    reply(c, r->data, r->len);
+  } else if (strcmp(name, "PING") == 0) {
+    reply_str(c, "+PONG\r\n");
+  } else if (strcmp(name, "HELLO") == 0) {
+    c->resp3 = (argc > 1 && strcmp(argv[1], "3") == 0);
+    reply_str(c, c->resp3 ? "%2\r\n$6\r\nserver\r\n$4\r\nmock\r\n$5\r\nproto\r\n:3\r\n"
+                          : "*4\r\n$6\r\nserver\r\n$4\r\nmock\r\n$5\r\nproto\r\n:2\r\n");
+  } else if (strcmp(name, "SUBSCRIBE") == 0 || strcmp(name, "PSUBSCRIBE") == 0) {
+    subscribe(c, argc, argv, name[0] == 'P');
+  } else if (strcmp(name, "UNSUBSCRIBE") == 0 || strcmp(name, "PUNSUBSCRIBE") == 0) {
+    unsubscribe(c, argc, argv, name[0] == 'P');
+  } else if (strcmp(name, "PUBLISH") == 0 && argc == 3) {
+    snprintf(buf, sizeof(buf), ":%d\r\n", publish(argv[1], argv[2]));
+    reply_str(c, buf);
+  } else if (strcmp(name, "SET") == 0 && argc >= 3) {
+    reply_str(c, "+OK\r\n");
+    notify(argv[1], "set");
+  } else if (strcmp(name, "GET") == 0) {
+    reply_str(c, c->resp3 ? "_\r\n" : "$-1\r\n");
+  } else if (strcmp(name, "CLIENT") == 0 && argc > 1
+             && strcasecmp(argv[1], "ID") == 0) {
+    snprintf(buf, sizeof(buf), ":%d\r\n", c->id);
+    reply_str(c, buf);
+  } else if (strcmp(name, "QUIT") == 0) {
+    reply_str(c, "+OK\r\n");
+    c->closing = true;
+  } else if (strcmp(name, "MOCK") == 0 && argc > 1
+             && strcasecmp(argv[1], "DROP") == 0) {
+    int j;
+    for (j = 0; j < nb_conns; j++) {
+      if (conns[j] != c) {
+        conns[j]->closing = true;
+      }
+    }
+    reply_str(c, "+OK\r\n");
+  } else if (strcmp(name, "MOCK") == 0 && argc > 2
+             && strcasecmp(argv[1], "RATE") == 0) {
+    options.rate = atof(argv[2]);
+    notify_start = now_us();
+    notified = 0;
+    reply_str(c, "+OK\r\n");
+  } else {
+    reply_str(c, "+OK\r\n");
+  }
+
+  if (options.drop_after > 0 && c->commands >= options.drop_after) {
+    c->closing = true;
+  }
+}
+
+
+/* Parse the multi-bulk commands of the input buffer */
+static void parse(conn_t* c) {
+
+  size_t pos = 0;
+  while (pos < c->in_len && !c->closing) {
+    char* p = c->in + pos;
+    char* end = c->in + c->in_len;
+    char* argv[MOCK_MAX_ARGS];
+    size_t argvlen[MOCK_MAX_ARGS];
+
+    if (*p != '*') {
+      c->closing = true;
+      return;
+    }
+    char* eol = memchr(p, '\n', end - p);
+    if (eol == NULL) {
+      break;
+    }
+    int argc = atoi(p + 1);
+    if (argc <= 0 || argc > MOCK_MAX_ARGS) {
+      c->closing = true;
+      return;
+    }
+    p = eol + 1;
+    int i;
+    for (i = 0; i < argc; i++) {
+      eol = p < end ? memchr(p, '\n', end - p) : NULL;
+      if (eol == NULL || *p != '$') {
+        break;
+      }
+      size_t len = strtoul(p + 1, NULL, 10);
+      p = eol + 1;
+      if ((size_t)(end - p) < len + 2) {
+        break;
+      }
+      argv[i] = p;
+      argvlen[i] = len;
+      p += len + 2;
+    }
+    if (i < argc) {
+      /* Incomplete */
+      break;
+    }
+    for (i = 0; i < argc; i++) {
+      argv[i][argvlen[i]] = '\0';
+    }
+    command(c, argc, argv);
+    pos = p - c->in;
+  }
+  memmove(c->in, c->in + pos, c->in_len - pos);
+  c->in_len -= pos;
+}
+
+
+static void close_conn(int index) {
+
+  conn_t* c = conns[index];
+  int i;
+  close(c->fd);
+  while (c->head != NULL) {
+    chunk_t* next = c->head->next;
+    free(c->head);
+    c->head = next;
+  }
+  for (i = 0; i < c->nb_subs; i++) {
+    free(c->subs[i]);
+  }
+  for (i = 0; i < c->nb_psubs; i++) {
+    free(c->psubs[i]);
+  }
+  free(c->in);
+  free(c);
+  conns[index] = conns[--nb_conns];
+}
+
+
+static void on_accept(int server) {
+
+  int fd = accept(server, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+  conn_t* c = (conn_t*)calloc(1, sizeof(conn_t));
+  if (nb_conns == MOCK_MAX_CONNS || c == NULL) {
+    free(c);
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  c->fd = fd;
+  c->id = next_id++;
+  conns[nb_conns++] = c;
+}
+
+
+static void on_readable(conn_t* c) {
+
+  if (c->in_size - c->in_len < 16384) {
+    size_t size = c->in_size ? c->in_size * 2 : 65536;
+    char* in = (char*)realloc(c->in, size);
+    if (in == NULL) {
+      c->closing = true;
+      return;
+    }
+    c->in = in;
+    c->in_size = size;
+  }
+  ssize_t n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    c->closing = true;
+    return;
+  }
+  if (n > 0) {
+    c->in_len += n;
+    parse(c);
+  }
+}
+
+
+/* Write the chunks due, one write per chunk */
+static void on_writable(conn_t* c, uint64_t now) {
+
+  while (c->head != NULL && c->head->due <= now) {
+    chunk_t* chunk = c->head;
+    ssize_t n = write(c->fd, chunk->data + chunk->off, chunk->len - chunk->off);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        c->closing = true;
+      }
+      return;
+    }
+    chunk->off += n;
+    if (chunk->off < chunk->len) {
+      return;
+    }
+    c->head = chunk->next;
+    if (c->head == NULL) {
+      c->tail = NULL;
+    }
+    free(chunk);
+    if (options.fragment > 0) {
+      /* One fragment per loop iteration */
+      return;
+    }
+  }
+}
+
+
+/* Synthetic notifications at the rate, key:<n % keys> */
+static void generate(uint64_t now) {
+
+  if (options.rate <= 0) {
+    return;
+  }
+  uint64_t target = (uint64_t)((now - notify_start) * options.rate / 1e6);
+  int burst = 0;
+  while (notified < target && burst < MOCK_MAX_BURST) {
+    char key[32];
+    snprintf(key, sizeof(key), "key:%llu",
+             (unsigned long long)(notified % options.keys));
+    notify(key, options.event);
+    notified++;
+    burst++;
+  }
+  if (notified < target) {
+    /* Too late, do not catch up */
+    notified = target;
+  }
+}
+
+
+/* Replies file, "COMMAND reply" lines */
+static int load_replies(const char* path) {
+
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  char line[8192];
+  while (fgets(line, sizeof(line), f) != NULL && nb_replies < MOCK_MAX_REPLIES) {
+    char* p = line;
+    while (isspace((unsigned char)*p)) {
+      p++;
+    }
+    if (*p == '#' || *p == '\0') {
+      continue;
+    }
+    reply_t* r = &replies[nb_replies];
+    size_t i = 0;
+    while (*p != '\0' && !isspace((unsigned char)*p) && i < sizeof(r->name) - 1) {
+      r->name[i++] = toupper((unsigned char)*p++);
+    }
+    r->name[i] = '\0';
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    r->data = (char*)malloc(strlen(p) + 1);
+    if (r->data == NULL) {
+      fclose(f);
+      return -1;
+    }
+    r->len = 0;
+    for (; *p != '\0' && *p != '\n'; p++) {
+      if (*p == '\\' && p[1] != '\0') {
+        p++;
+        r->data[r->len++] = *p == 'r' ? '\r' : *p == 'n' ? '\n' : *p == 't' ? '\t' : *p;
+      } else {
+        r->data[r->len++] = *p;
+      }
+    }
+    nb_replies++;
+  }
+  fclose(f);
+  return 0;
+}
+
+
+static void usage(const char* name) {
+  fprintf(stderr, "usage: %s [-s path] [-r replies] [-l latency_ms] [-j jitter_ms] "
+          "[-f fragment_bytes] [-g fragment_gap_ms] [-n notifications_per_s] "
+          "[-k keys] [-e event] [-d drop_after]\n", name);
+}
+
+
+int main(int argc, char** argv) {
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:l:j:f:g:n:k:e:d:h")) != -1) {
+    switch (opt) {
+      case 's': options.path = optarg; break;
+      case 'r': if (load_replies(optarg) != 0) return 1; break;
+      case 'l': options.latency = strtoull(optarg, NULL, 10) * 1000; break;
+      case 'j': options.jitter = strtoull(optarg, NULL, 10) * 1000; break;
+      case 'f': options.fragment = strtoul(optarg, NULL, 10); break;
+      case 'g': options.fragment_gap = strtoull(optarg, NULL, 10) * 1000; break;
+      case 'n': options.rate = atof(optarg); break;
+      case 'k': options.keys = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+      case 'e': options.event = optarg; break;
+      case 'd': options.drop_after = strtoull(optarg, NULL, 10); break;
+      default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR1, on_usr1);
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, options.path, sizeof(addr.sun_path) - 1);
+  unlink(options.path);
+  if (server < 0 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0
+      || listen(server, 128) != 0) {
+    perror(options.path);
+    return 1;
+  }
+  fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+
+  static struct pollfd fds[MOCK_MAX_CONNS + 1];
+  notify_start = now_us();
+
+  for (;;) {
+    uint64_t now = now_us();
+    int i;
+
+    if (drop_all) {
+      drop_all = 0;
+      for (i = 0; i < nb_conns; i++) {
+        conns[i]->closing = true;
+      }
+    }
+    generate(now);
+
+    /* Close after the replies already due */
+    for (i = nb_conns - 1; i >= 0; i--) {
+      if (conns[i]->closing) {
+        on_writable(conns[i], now);
+        close_conn(i);
+      }
+    }
+
+    /* Wait for the next reply, notification or request */
+    int timeout = options.rate > 0 ? 1 : -1;
+    fds[0].fd = server;
+    fds[0].events = POLLIN;
+    for (i = 0; i < nb_conns; i++) {
+      conn_t* c = conns[i];
+      fds[i + 1].fd = c->fd;
+      fds[i + 1].events = POLLIN;
+      if (c->head != NULL) {
+        if (c->head->due <= now) {
+          fds[i + 1].events |= POLLOUT;
+        } else {
+          int wait = (int)((c->head->due - now + 999) / 1000);
+          if (timeout < 0 || wait < timeout) {
+            timeout = wait;
+          }
+        }
+      }
+    }
+
+    int n = poll(fds, nb_conns + 1, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return 1;
+    }
+
+    now = now_us();
+    int count = nb_conns;
+    for (i = 0; i < count; i++) {
+      conn_t* c = conns[i];
+      if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+        on_readable(c);
+      }
+      if (!c->closing) {
+        on_writable(c, now);
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      on_accept(server);
+    }
+  }
+  return 0;
+}
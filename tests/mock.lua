@@ -0,0 +1,211 @@
+--[[
+
+The MIT License (MIT)
+
+Copyright (c) 2015 gsick
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+--]]
+
+--[[
+
+Cases against the RESP mock server (tests/mock-redis.c), each one starts its
+own build/mock-redis with its flags:
+
+  make mock && luvit tests/mock.lua
+
+--]]
+
+local Timer = require('timer')
+local ChildProcess = require('childprocess')
+
+local CrazySnail = require('crazy-snail')
+
+local MOCK = os.getenv("MOCK_REDIS") or "build/mock-redis"
+local SOCKET = os.getenv("MOCK_SOCKET") or "/tmp/crazysnail-mock-test.sock"
+
+local cases = {}
+local current
+
+local function case(name, flags, fn)
+  table.insert(cases, {name = name, flags = flags, fn = fn})
+end
+
+-- The callbacks are called in protected mode, a failed check exits
+local function check(cond, msg)
+  if not cond then
+    print("FAIL " .. current.name .. ": " .. tostring(msg))
+    if current.child ~= nil then current.child:kill() end
+    process.exit(1)
+  end
+end
+
+local function run(i)
+  current = cases[i]
+  if current == nil then
+    print("all passed")
+    process.exit(0)
+    return
+  end
+
+  local args = {"-s", SOCKET}
+  for _, flag in ipairs(current.flags) do table.insert(args, flag) end
+  current.child = ChildProcess.spawn(MOCK, args)
+
+  local timeout = Timer.setTimeout(10000, function()
+    check(false, "timeout")
+  end)
+
+  local function done()
+    Timer.clearTimer(timeout)
+    current.child:kill()
+    print("ok " .. current.name)
+    Timer.setTimeout(100, function() run(i + 1) end)
+  end
+
+  -- Let the mock listen
+  Timer.setTimeout(200, function()
+    local ok, err = pcall(current.fn, done)
+    check(ok, err)
+  end)
+end
+
+-- Every reply and notification split in 3-byte writes, 1 ms apart
+case("fragmented replies", {"-f", "3", "-g", "1", "-n", "20", "-k", "4"}, function(done)
+  local snail = CrazySnail.new({path = SOCKET})
+  local replies, notifications = 0, 0
+
+  local function finish()
+    if replies == 100 and notifications >= 5 then
+      notifications = -1
+      snail:disconnect()
+      done()
+    end
+  end
+
+  snail:on('connect', function()
+    snail:subscribe("set", function(err, res)
+      check(err == nil, err)
+      check(res[1] == "set", res[1])
+      check(res[2]:sub(1, 3) == "key" or res[2]:sub(1, 1) == "a", res[2])
+      if notifications >= 0 then
+        notifications = notifications + 1
+        finish()
+      end
+    end)
+    for i = 1, 50 do
+      snail:command("set", "a" .. i, string.rep("v", i), function(err, res)
+        check(err == nil, err)
+        check(res == "OK", res)
+        replies = replies + 1
+        finish()
+      end)
+      snail:command("get", "a" .. i, function(err, res)
+        check(err == nil, err)
+        check(res == nil, res)
+        replies = replies + 1
+        finish()
+      end)
+    end
+  end)
+  snail:connect()
+end)
+
+-- The mock closes the connection after 6 commands, the pending ones fail
+case("reconnect", {"-d", "6"}, function(done)
+  local snail = CrazySnail.new({path = SOCKET, resp3 = true})
+  local connects, replies, failures = 0, 0, 0
+
+  snail:on('error', function() end)
+  snail:on('connect', function()
+    connects = connects + 1
+    if connects == 1 then
+      for i = 1, 10 do
+        snail:command("ping", function(err, res)
+          if err == nil then
+            check(res == "PONG", res)
+            replies = replies + 1
+          else
+            check(err == "command: Disconnected", err)
+            failures = failures + 1
+          end
+        end)
+      end
+    else
+      snail:command("ping", function(err, res)
+        check(err == nil, err)
+        check(res == "PONG", res)
+        snail:disconnect()
+        done()
+      end)
+    end
+  end)
+  snail:on('disconnect', function()
+    if connects == 1 then
+      check(replies + failures == 10, replies + failures)
+      check(replies > 0 and failures > 0, replies .. "/" .. failures)
+      snail:connect()
+    end
+  end)
+  snail:connect()
+end)
+
+-- A write between two identical reads ends the sharing
+case("single flight", {"-l", "20"}, function(done)
+  local snail = CrazySnail.new({path = SOCKET, single_flight = true})
+  local order = {}
+
+  snail:on('connect', function()
+    snail:command("get", "x", function() table.insert(order, "get1") end)
+    snail:command("get", "x", function() table.insert(order, "get2") end)
+    snail:command("set", "x", "v", function() table.insert(order, "set") end)
+    snail:command("get", "x", function()
+      table.insert(order, "get3")
+      check(#order == 4 and order[3] == "set", table.concat(order, ","))
+      -- get2 shared the reply of get1, get3 was sent
+      check(snail:stats().latency.get.count == 2, snail:stats().latency.get.count)
+      snail:disconnect()
+      done()
+    end)
+  end)
+  snail:connect()
+end)
+
+-- The batched GET are flushed before the other commands of the loop iteration
+case("batch ordering", {"-l", "5"}, function(done)
+  local snail = CrazySnail.new({path = SOCKET, auto_batch = true})
+  local order = {}
+
+  snail:script("one", "return 1")
+  snail:on('connect', function()
+    snail:command("get", "a", function() table.insert(order, "get1") end)
+    snail:eval("one", {"a"}, {}, function() table.insert(order, "eval") end)
+    snail:command("get", "b", function() table.insert(order, "get2") end)
+    snail:scan({}, function() end, function() table.insert(order, "scan") end)
+    snail:command("get", "c", function()
+      table.insert(order, "get3")
+      check(table.concat(order, ",") == "get1,eval,get2,scan,get3", table.concat(order, ","))
+      snail:disconnect()
+      done()
+    end)
+  end)
+  snail:connect()
+end)
+
+run(1)
@@ -3,7 +3,7 @@ local Timer = require('timer')
 
 local CrazySnail = require('crazy-snail')
 
-snail = CrazySnail.new({path = "/var/run/redis/redis.sock"})
+snail = CrazySnail.new({path = os.getenv("REDIS_SOCKET") or "/var/run/redis/redis.sock"})
 snail:connect()
 
 local i = 0